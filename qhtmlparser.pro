@@ -1,2 +1,5 @@
 TEMPLATE = subdirs
-SUBDIRS += src
+CONFIG += ordered
+SUBDIRS += \
+    src \
+    tools/qhtmlreplay
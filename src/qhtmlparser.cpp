@@ -17,8 +17,52 @@
 #include "qhtmlparser.h"
 #include <tidy.h>
 #include <tidybuffio.h>
+#include <QCache>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
 #include <QIODevice>
+#include <QMutex>
+#include <QPair>
 #include <QRegExp>
+#if QT_VERSION >= 0x050000
+#include <QRegularExpression>
+#endif
+#include <QThread>
+#include <QThreadStorage>
+#include <QUrl>
+#include <QVector>
+#include <algorithm>
+#include <QtEndian>
+#include <string.h>
+
+#ifdef QHTMLPARSER_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define QHTMLPARSER_SEMAPHORE(name) \
+    __extension__ unsigned short qhtmlparser_##name##_semaphore __attribute__((unused)) \
+    __attribute__((section(".probes")))
+
+QHTMLPARSER_SEMAPHORE(parse__start);
+QHTMLPARSER_SEMAPHORE(parse__done);
+QHTMLPARSER_SEMAPHORE(query__start);
+QHTMLPARSER_SEMAPHORE(query__done);
+QHTMLPARSER_SEMAPHORE(render__start);
+QHTMLPARSER_SEMAPHORE(render__done);
+
+#define QHTMLPARSER_PROBE_ENABLED(name) __builtin_expect(qhtmlparser_##name##_semaphore, 0)
+#define QHTMLPARSER_PROBE2(name, a, b) DTRACE_PROBE2(qhtmlparser, name, a, b)
+#define QHTMLPARSER_PROBE3(name, a, b, c) DTRACE_PROBE3(qhtmlparser, name, a, b, c)
+#define QHTMLPARSER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(qhtmlparser, name, a, b, c, d)
+#else
+#define QHTMLPARSER_PROBE_ENABLED(name) false
+#define QHTMLPARSER_PROBE2(name, a, b)
+#define QHTMLPARSER_PROBE3(name, a, b, c)
+#define QHTMLPARSER_PROBE4(name, a, b, c, d)
+#endif
 
 static ctmbstr nodeAttribute(TidyNode node, const QString &name) {
     TidyAttr attr;
@@ -32,7 +76,8 @@ static ctmbstr nodeAttribute(TidyNode node, const QString &name) {
     return 0;
 }
 
-static bool matchAttribute(const QString &value, const QHtmlAttributeMatch &match) {
+template <typename Counters>
+static bool matchAttribute(const QString &value, const QHtmlAttributeMatch &match, int index, Counters &counters) {
     bool matches = false;
     
     if (match.testFlag(QHtmlParser::MatchExactly)) {
@@ -57,10 +102,12 @@ static bool matchAttribute(const QString &value, const QHtmlAttributeMatch &matc
                                  ? Qt::CaseSensitive : Qt::CaseInsensitive);
     }
     else if (match.testFlag(QHtmlParser::MatchRegExp)) {
+        counters.compile(index);
         matches = value.contains(QRegExp(match.value(), match.testFlag(QHtmlParser::MatchCaseSensitive)
                                  ? Qt::CaseSensitive : Qt::CaseInsensitive));
     }
     else if (match.testFlag(QHtmlParser::MatchWildcard)) {
+        counters.compile(index);
         matches = value.contains(QRegExp(match.value(), match.testFlag(QHtmlParser::MatchCaseSensitive)
                                  ? Qt::CaseSensitive : Qt::CaseInsensitive, QRegExp::Wildcard));
     }
@@ -68,12 +115,16 @@ static bool matchAttribute(const QString &value, const QHtmlAttributeMatch &matc
     return matches;
 }
 
-static bool matchAttributes(TidyNode node, const QHtmlAttributeMatches &matches, QHtmlParser::MatchType matchType) {    
+template <typename Counters>
+static bool matchAttributes(TidyNode node, const QHtmlAttributeMatches &matches, QHtmlParser::MatchType matchType,
+                            Counters &counters) {    
     if (matchType == QHtmlParser::MatchAll) {        
-        foreach (const QHtmlAttributeMatch &match, matches) {
-            const ctmbstr value = nodeAttribute(node, match.name());
+        for (int i = 0; i < matches.size(); ++i) {
+            const ctmbstr value = nodeAttribute(node, matches.at(i).name());
+            const bool matched = (value) && (matchAttribute(value, matches.at(i), i, counters));
+            counters.evaluate(i, matched);
             
-            if ((!value) || (!matchAttribute(value, match))) {
+            if (!matched) {
                 return false;
             }
         }
@@ -81,10 +132,12 @@ static bool matchAttributes(TidyNode node, const QHtmlAttributeMatches &matches,
         return true;
     }
         
-    foreach (const QHtmlAttributeMatch &match, matches) {
-        const ctmbstr value = nodeAttribute(node, match.name());
+    for (int i = 0; i < matches.size(); ++i) {
+        const ctmbstr value = nodeAttribute(node, matches.at(i).name());
+        const bool matched = (value) && (matchAttribute(value, matches.at(i), i, counters));
+        counters.evaluate(i, matched);
         
-        if ((value) && (matchAttribute(value, match))) {
+        if (matched) {
             return true;
         }
     }
@@ -142,6 +195,44 @@ static TidyNode nextSiblingStartNode(TidyNode node) {
     return 0;
 }
 
+/*
+ * Returns the node following node in document order among the descendants of scope, or 0. 
+ * If descend is false, the children of node are skipped.
+ */
+static TidyNode nextNode(TidyNode node, TidyNode scope, bool descend = true) {
+    if (descend) {
+        const TidyNode child = tidyGetChild(node);
+        
+        if (child) {
+            return child;
+        }
+    }
+    
+    for (; (node) && (node != scope); node = tidyGetParent(node)) {
+        const TidyNode next = tidyGetNext(node);
+        
+        if (next) {
+            return next;
+        }
+    }
+    
+    return 0;
+}
+
+static TidyNode nextStartNode(TidyNode node, TidyNode scope, bool descend = true) {
+    for (node = nextNode(node, scope, descend); node; node = nextNode(node, scope)) {
+        switch (tidyNodeGetType(node)) {
+        case TidyNode_Start:
+        case TidyNode_StartEnd:
+            return node;
+        default:
+            break;
+        }
+    }
+    
+    return 0;
+}
+
 static void allStartNodes(TidyNode node, QList<TidyNode> &nodes) {
     TidyNode child;
     
@@ -176,26 +267,73 @@ static QList<TidyNode> childStartNodes(TidyNode node) {
     return nodes;
 }
 
-static void allTextNodes(TidyNode node, QList<TidyNode> &nodes) {
-    TidyNode child;
-    
-    for (child = tidyGetChild(node); child; child = tidyGetNext(child)) {
-        switch (tidyNodeGetType(child)) {
-        case TidyNode_Text:
-            nodes << child;
-            break;
-        default:
-            break;
+/*
+ * As nextNode(), but does not descend more than maxDepth levels below scope. depth is the 
+ * depth of node below scope, and is updated to the depth of the returned node.
+ */
+static TidyNode nextNode(TidyNode node, TidyNode scope, int &depth, int maxDepth) {
+    if (depth < maxDepth) {
+        const TidyNode child = tidyGetChild(node);
+        
+        if (child) {
+            ++depth;
+            return child;
         }
+    }
+    
+    for (; (node) && (node != scope); node = tidyGetParent(node), --depth) {
+        const TidyNode next = tidyGetNext(node);
         
-        allTextNodes(child, nodes);
+        if (next) {
+            return next;
+        }
     }
+    
+    return 0;
 }
 
-static QList<TidyNode> allTextNodes(TidyNode node) {
-    QList<TidyNode> nodes;
-    allTextNodes(node, nodes);
-    return nodes;
+static inline bool isStartNode(TidyNode node) {
+    const TidyNodeType type = tidyNodeGetType(node);
+    return (type == TidyNode_Start) || (type == TidyNode_StartEnd);
+}
+
+/*
+ * Appends the text of node to buffer: the text of every text node below node if includeChildElements 
+ * is true, otherwise only its first direct text child.
+ */
+static void appendText(TidyDoc document, TidyNode node, bool includeChildElements, TidyBuffer &buffer) {
+    if (includeChildElements) {
+        for (TidyNode child = nextNode(node, node); child; child = nextNode(child, node)) {
+            if (tidyNodeGetType(child) == TidyNode_Text) {
+                tidyNodeGetText(document, child, &buffer);
+            }
+        }
+    }
+    else {
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            if (tidyNodeGetType(child) == TidyNode_Text) {
+                tidyNodeGetText(document, child, &buffer);
+                break;
+            }
+        }
+    }
+}
+
+// Returns the text in buffer, without the line break that ends the last text node.
+static QString bufferText(const TidyBuffer &buffer) {
+    if (buffer.size == 0) {
+        return QString();
+    }
+    
+    return QString::fromUtf8((char*)buffer.bp, buffer.bp[buffer.size - 1] == '\n' ? buffer.size - 1 : buffer.size);
+}
+
+template <typename Counters>
+static bool matchNode(TidyNode node, const QByteArray &name, const QHtmlAttributeMatches *matches,
+                      QHtmlParser::MatchType matchType, Counters &counters) {
+    counters.visit();
+    return (qstrcmp(tidyNodeGetName(node), name.constData()) == 0)
+        && ((!matches) || (matchAttributes(node, *matches, matchType, counters)));
 }
 
 QHtmlAttribute::QHtmlAttribute() {}
@@ -271,673 +409,4371 @@ bool QHtmlAttributeMatch::operator!=(const QHtmlAttributeMatch &other) const {
     return (other.name() != name()) || (other.value() != value()) || (other.flags() != flags());
 }
 
-class QHtmlElementPrivate
-{
-
-public:
-    QHtmlElementPrivate() :
-        document(0),
-        node(0)
-    {
-    }
+QString QHtmlQueryProfile::toString() const {
+    QString report;
     
-    ~QHtmlElementPrivate() {}    
+    switch (strategy) {
+    case QHtmlParser::FullScan:
+        report = "strategy: full scan\n";
+        break;
+    case QHtmlParser::AttributeIndex:
+        report = "strategy: attribute index\n";
+        break;
+    case QHtmlParser::ValueIndex:
+        report = "strategy: value index\n";
+        break;
+    default:
+        break;
+    }
     
-    TidyDoc document;
-    TidyNode node;
-};
-
-QHtmlElement::QHtmlElement() :
-    d(new QHtmlElementPrivate)
-{
-}
-
-QHtmlElement::QHtmlElement(const QHtmlElement &other) :
-    d(new QHtmlElementPrivate)
-{
-    d->document = other.d->document;
-    d->node = other.d->node;
-}
-
-QHtmlElement::~QHtmlElement() {
-    delete d;
-}
-
-QHtmlAttributes QHtmlElement::attributes() const {
-    QHtmlAttributes attrs;
+    report += QString("nodes visited: %1\n").arg(stats.nodesVisited);
+    report += QString("predicates evaluated: %1\n").arg(stats.predicatesEvaluated);
+    report += QString("matches: %1\n").arg(stats.matches);
+    report += QString("elapsed: %1 ms\n").arg(stats.elapsed / 1000000.0);
     
-    if (!d->node) {
-        return attrs;
+    for (int i = 0; i < matches.size(); ++i) {
+        const QHtmlAttributeMatchProfile &profile = matches.at(i);
+        report += QString("match %1 (%2, \"%3\", flags 0x%4): %5 evaluations, %6 successes, %7 regexp compiles\n")
+                  .arg(i).arg(profile.match.name()).arg(profile.match.value())
+                  .arg(QString::number(int(profile.match.flags()), 16)).arg(profile.evaluations)
+                  .arg(profile.successes).arg(profile.regExpCompiles);
     }
     
-    TidyAttr attr;
+    return report;
+}
+
+int QHtmlTextFingerprint::distance(const QHtmlTextFingerprint &other) const {
+    quint64 bits = simHash ^ other.simHash;
+    int count = 0;
     
-    for (attr = tidyAttrFirst(d->node); attr; attr = tidyAttrNext(attr)) {
-        attrs << QHtmlAttribute(tidyAttrName(attr), tidyAttrValue(attr));
+    while (bits) {
+        bits &= bits - 1;
+        ++count;
     }
     
-    return attrs;
+    return count;
 }
 
-QString QHtmlElement::attribute(const QString &name) const {
-    if (!d->node) {
-        return QString();
+double QHtmlTextFingerprint::similarity(const QHtmlTextFingerprint &other) const {
+    if ((minHash.isEmpty()) || (minHash.size() != other.minHash.size())) {
+        return -1;
     }
     
-    const ctmbstr value = nodeAttribute(d->node, name);
+    int equal = 0;
     
-    if (value) {
-        return value;
+    for (int i = 0; i < minHash.size(); ++i) {
+        if (minHash.at(i) == other.minHash.at(i)) {
+            ++equal;
+        }
     }
     
-    return QString();
+    return double(equal) / minHash.size();
 }
 
-QHtmlElement QHtmlElement::parentElement() const {
-    QHtmlElement element;
-
-    if (!d->node) {
-        return element;
+static void countNodes(TidyNode node, int depth, int &count, int &maxDepth) {
+    for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+        ++count;
+        maxDepth = qMax(maxDepth, depth);
+        countNodes(child, depth + 1, count, maxDepth);
     }
+}
 
-    TidyNode node = tidyGetParent(d->node);
+// The instrumentation that is currently active, kept in a single flag set so that parsing, queries and
+// renders can skip all of it with one atomic load.
+enum InstrumentationSink {
+    RecorderSink = 1,
+    TracerSink = 2,
+    MonitorSink = 4,
+    MetricsSink = 8
+};
 
-    if (node) {
-        element.d->document = d->document;
-        element.d->node = node;
-    }
+static QAtomicInt activeSinks;
 
-    return element;
+static inline int instrumentationSinks() {
+#if QT_VERSION >= 0x050000
+    return activeSinks.loadAcquire();
+#else
+    return activeSinks;
+#endif
 }
 
-QHtmlElement QHtmlElement::nextSibling() const {
-    QHtmlElement element;
-
-    if (!d->node) {
-        return element;
+static void setSinkActive(InstrumentationSink sink, bool active) {
+    int sinks = instrumentationSinks();
+    
+    while (!activeSinks.testAndSetOrdered(sinks, active ? (sinks | sink) : (sinks & ~sink))) {
+        sinks = instrumentationSinks();
     }
+}
 
-    TidyNode node = nextSiblingStartNode(d->node);
-
-    if (node) {
-        element.d->document = d->document;
-        element.d->node = node;
+static quint64 hashBytes(const char *data, int size, quint64 seed = 0) {
+    const quint64 m = Q_UINT64_C(0xc6a4a7935bd1e995);
+    const int r = 47;
+    const uchar *bytes = reinterpret_cast<const uchar*>(data);
+    const uchar *end = bytes + (size & ~7);
+    quint64 h = seed ^ (quint64(size) * m);
+    
+    for (; bytes != end; bytes += 8) {
+        quint64 k = qFromLittleEndian<quint64>(bytes);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
     }
-
-    return element;
+    
+    switch (size & 7) {
+    case 7:
+        h ^= quint64(bytes[6]) << 48;
+        // fall through
+    case 6:
+        h ^= quint64(bytes[5]) << 40;
+        // fall through
+    case 5:
+        h ^= quint64(bytes[4]) << 32;
+        // fall through
+    case 4:
+        h ^= quint64(bytes[3]) << 24;
+        // fall through
+    case 3:
+        h ^= quint64(bytes[2]) << 16;
+        // fall through
+    case 2:
+        h ^= quint64(bytes[1]) << 8;
+        // fall through
+    case 1:
+        h ^= quint64(bytes[0]);
+        h *= m;
+        break;
+    default:
+        break;
+    }
+    
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
 }
 
-QHtmlElement QHtmlElement::previousSibling() const {
-    QHtmlElement element;
-
-    if (!d->node) {
-        return element;
-    }
+static inline quint64 mixHash(quint64 h) {
+    h ^= h >> 33;
+    h *= Q_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
 
-    TidyNode node = previousSiblingStartNode(d->node);
+static inline bool isScriptOrStyle(TidyNode node) {
+    const TidyTagId id = tidyNodeGetId(node);
+    return (id == TidyTag_SCRIPT) || (id == TidyTag_STYLE);
+}
 
-    if (node) {
-        element.d->document = d->document;
-        element.d->node = node;
+static inline bool isInline(TidyNode node) {
+    switch (tidyNodeGetId(node)) {
+    case TidyTag_A:
+    case TidyTag_ABBR:
+    case TidyTag_ACRONYM:
+    case TidyTag_B:
+    case TidyTag_BDO:
+    case TidyTag_BIG:
+    case TidyTag_CITE:
+    case TidyTag_CODE:
+    case TidyTag_DFN:
+    case TidyTag_EM:
+    case TidyTag_FONT:
+    case TidyTag_I:
+    case TidyTag_KBD:
+    case TidyTag_LABEL:
+    case TidyTag_Q:
+    case TidyTag_S:
+    case TidyTag_SAMP:
+    case TidyTag_SMALL:
+    case TidyTag_SPAN:
+    case TidyTag_STRIKE:
+    case TidyTag_STRONG:
+    case TidyTag_SUB:
+    case TidyTag_SUP:
+    case TidyTag_TT:
+    case TidyTag_U:
+    case TidyTag_VAR:
+        return true;
+    default:
+        return false;
     }
+}
 
-    return element;
+static inline bool isWordByte(uchar c) {
+    // Bytes of multi-byte UTF-8 sequences are treated as letters.
+    return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c >= 0x80);
 }
 
-QHtmlElementList QHtmlElement::childElements() const {
-    QHtmlElementList elements;
-    
-    if (!d->node) {
-        return elements;
-    }
+// Splits size bytes of UTF-8 text into lower-case tokens and passes each to sink.token(token, node, offset).
+template <typename Sink>
+static void tokenizeBytes(const uchar *data, int size, TidyNode node, QByteArray &token, Sink &sink) {
+    int start = -1;
     
-    foreach (TidyNode node, childStartNodes(d->node)) {
-        QHtmlElement element;
-        element.d->document = d->document;
-        element.d->node = node;
-        elements << element;
+    for (int i = 0; i <= size; ++i) {
+        const uchar c = (i < size ? data[i] : 0);
+        
+        if (isWordByte(c)) {
+            if (start < 0) {
+                start = i;
+                token.resize(0);
+            }
+            
+            token += char(((c >= 'A') && (c <= 'Z')) ? c + ('a' - 'A') : c);
+        }
+        else if (start >= 0) {
+            sink.token(token, node, start);
+            start = -1;
+        }
     }
-    
-    return elements;
 }
 
-QHtmlElement QHtmlElement::firstChildElement() const {
-    QHtmlElement element;
-    
-    if (!d->node) {
-        return element;
-    }
-    
-    TidyNode node = childStartNode(d->node);
-    
-    if (node) {
-        element.d->document = d->document;
-        element.d->node = node;
+/*
+ * Splits the text nodes below node into lower-case tokens, skipping script and style elements, 
+ * and passes each token to sink.token(token, textNode, offset), where offset is the byte offset 
+ * of the token in the text node. sink.boundary() is called before and after each element that is 
+ * not inline, as the tokens on either side of it are not adjacent in the rendered text. The buffer 
+ * and token are reused between calls to avoid allocation.
+ */
+template <typename Sink>
+static void tokenizeText(TidyDoc document, TidyNode node, TidyBuffer &buffer, QByteArray &token, Sink &sink) {
+    for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+        switch (tidyNodeGetType(child)) {
+        case TidyNode_Text:
+            tidyBufClear(&buffer);
+            
+            if (tidyNodeGetValue(document, child, &buffer)) {
+                tokenizeBytes(buffer.bp, buffer.size, child, token, sink);
+            }
+            
+            break;
+        case TidyNode_Start:
+        case TidyNode_StartEnd:
+            if (!isScriptOrStyle(child)) {
+                const bool block = !isInline(child);
+                
+                if (block) {
+                    sink.boundary();
+                }
+                
+                tokenizeText(document, child, buffer, token, sink);
+                
+                if (block) {
+                    sink.boundary();
+                }
+            }
+            
+            break;
+        default:
+            break;
+        }
     }
-    
-    return element;
 }
 
-QHtmlElement QHtmlElement::lastChildElement() const {
-    QHtmlElement element;
-    
-    if (!d->node) {
-        return element;
-    }
-    
-    const QList<TidyNode> nodes = childStartNodes(d->node);
-    
-    if (!nodes.isEmpty()) {
-        element.d->document = d->document;
-        element.d->node = nodes.last();
-    }
-    
-    return element;
+template <typename Sink>
+static void tokenizeText(TidyDoc document, TidyNode node, Sink &sink) {
+    TidyBuffer buffer = TidyBuffer();
+    QByteArray token;
+    token.reserve(64);
+    tokenizeText(document, node, buffer, token, sink);
+    tidyBufFree(&buffer);
 }
 
-QHtmlElement QHtmlElement::nthChildElement(int n) const {
-    if (n == 0) {
-        return firstChildElement();
+// Collects the tokens of a text.
+class TermSink
+{
+
+public:
+    void token(const QByteArray &token, TidyNode, int) {
+        tokens << token;
     }
     
-    QHtmlElement element;
-    
-    if (!d->node) {
-        return element;
+    QList<QByteArray> tokens;
+};
+
+// Numbers the tokens of a document and records the positions of each distinct token.
+class TextIndexSink
+{
+
+public:
+    TextIndexSink(QHash<QByteArray, int> &ids, QVector< QVector<int> > &postings, QVector<int> &tokenIds,
+                  QVector<TidyNode> &tokenNodes) :
+        ids(ids),
+        postings(postings),
+        tokenIds(tokenIds),
+        tokenNodes(tokenNodes)
+    {
     }
     
-    const QList<TidyNode> nodes = childStartNodes(d->node);
-    
-    if (n < 0) {
-        if (nodes.size() + n >= 0) {
-            element.d->document = d->document;
-            element.d->node = nodes.at(nodes.size() + n);
+    void token(const QByteArray &token, TidyNode node, int) {
+        const QHash<QByteArray, int>::const_iterator iterator = ids.constFind(token);
+        int id;
+        
+        if (iterator == ids.constEnd()) {
+            id = postings.size();
+            ids.insert(token, id);
+            postings.resize(id + 1);
+        }
+        else {
+            id = iterator.value();
         }
+        
+        postings[id] << tokenIds.size();
+        tokenIds << id;
+        tokenNodes << node;
     }
-    else if (n < nodes.size() - 1) {
-        element.d->document = d->document;
-        element.d->node = nodes.at(n);
+    
+    // Separates the tokens on either side by an id that matches no token, so that no phrase spans them.
+    void boundary() {
+        if ((!tokenIds.isEmpty()) && (tokenIds.last() >= 0)) {
+            tokenIds << -1;
+            tokenNodes << 0;
+        }
     }
 
-    return element;
+private:
+    QHash<QByteArray, int> &ids;
+    QVector< QVector<int> > &postings;
+    QVector<int> &tokenIds;
+    QVector<TidyNode> &tokenNodes;
+};
+
+typedef QPair<TidyNode, TidyNode> TextSpan;
+
+// Finds each occurrence of a phrase in the tokens of a document, as the text nodes of its first and last token.
+class PhraseSink
+{
+
+public:
+    explicit PhraseSink(const QList<QByteArray> &phrase) :
+        phrase(phrase)
+    {
+    }
+    
+    void token(const QByteArray &token, TidyNode node, int) {
+        // Each partial occurrence is stored as its first text node and the number of tokens matched.
+        int kept = 0;
+        
+        for (int i = 0; i < partial.size(); ++i) {
+            const int matched = partial.at(i).second;
+            
+            if (token == phrase.at(matched)) {
+                if (matched + 1 == phrase.size()) {
+                    spans << TextSpan(partial.at(i).first, node);
+                }
+                else {
+                    partial[kept++] = qMakePair(partial.at(i).first, matched + 1);
+                }
+            }
+        }
+        
+        partial.resize(kept);
+        
+        if (token == phrase.first()) {
+            if (phrase.size() == 1) {
+                spans << TextSpan(node, node);
+            }
+            else {
+                partial << qMakePair(node, 1);
+            }
+        }
+    }
+    
+    void boundary() {
+        partial.clear();
+    }
+    
+    QList<TextSpan> spans;
+
+private:
+    const QList<QByteArray> phrase;
+    QVector< QPair<TidyNode, int> > partial;
+};
+
+class FingerprintSink
+{
+
+public:
+    explicit FingerprintSink(int minHashCount) :
+        minHash(qMax(0, minHashCount), ~Q_UINT64_C(0)),
+        count(0)
+    {
+        memset(weights, 0, sizeof(weights));
+    }
+    
+    void token(const QByteArray &token, TidyNode, int) {
+        const quint64 hash = hashBytes(token.constData(), token.size());
+        
+        for (int bit = 0; bit < 64; ++bit) {
+            weights[bit] += (((hash >> bit) & 1) ? 1 : -1);
+        }
+        
+        for (int i = 0; i < minHash.size(); ++i) {
+            const quint64 value = mixHash(hash ^ (Q_UINT64_C(0x9e3779b97f4a7c15) * quint64(i + 1)));
+            
+            if (value < minHash.at(i)) {
+                minHash[i] = value;
+            }
+        }
+        
+        ++count;
+    }
+    
+    // The fingerprint does not depend on the order of the tokens.
+    void boundary() {}
+    
+    QHtmlTextFingerprint fingerprint() const {
+        QHtmlTextFingerprint result;
+        
+        for (int bit = 0; bit < 64; ++bit) {
+            if (weights[bit] > 0) {
+                result.simHash |= Q_UINT64_C(1) << bit;
+            }
+        }
+        
+        if (count > 0) {
+            result.minHash = minHash;
+        }
+        
+        result.tokenCount = count;
+        return result;
+    }
+
+private:
+    int weights[64];
+    QVector<quint64> minHash;
+    int count;
+};
+
+class StatisticsCollector
+{
+
+public:
+    explicit StatisticsCollector(TidyDoc doc) :
+        document(doc),
+        buffer(TidyBuffer()),
+        depthSum(0)
+    {
+        memset(tagCounts, 0, sizeof(tagCounts));
+        memset(tagNames, 0, sizeof(tagNames));
+    }
+    
+    ~StatisticsCollector() {
+        tidyBufFree(&buffer);
+    }
+    
+    /*
+     * Known tags are counted by tag id in a fixed table, and named once the traversal is done. Tidy 
+     * copies the tag name into each node, so only unknown tags, which have no id, are counted by name.
+     */
+    void collect(TidyNode node, int depth, TidyTagId container) {
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            ++statistics.nodeCount;
+            statistics.maxDepth = qMax(statistics.maxDepth, depth);
+            
+            switch (tidyNodeGetType(child)) {
+            case TidyNode_Start:
+            case TidyNode_StartEnd:
+                ++statistics.elementCount;
+                depthSum += depth;
+                countTag(child);
+                
+                for (TidyAttr attr = tidyAttrFirst(child); attr; attr = tidyAttrNext(attr)) {
+                    ++statistics.attributeCount;
+                }
+                
+                collect(child, depth + 1, isScriptOrStyle(child) ? tidyNodeGetId(child) : container);
+                break;
+            case TidyNode_Text:
+            case TidyNode_CDATA:
+                tidyBufClear(&buffer);
+                
+                if (tidyNodeGetValue(document, child, &buffer)) {
+                    statistics.textBytes += buffer.size;
+                    
+                    if (container == TidyTag_SCRIPT) {
+                        statistics.scriptBytes += buffer.size;
+                    }
+                    else if (container == TidyTag_STYLE) {
+                        statistics.styleBytes += buffer.size;
+                    }
+                }
+                
+                collect(child, depth + 1, container);
+                break;
+            default:
+                collect(child, depth + 1, container);
+                break;
+            }
+        }
+    }
+    
+    QHtmlDocumentStatistics result() {
+        if (statistics.elementCount > 0) {
+            statistics.meanDepth = double(depthSum) / statistics.elementCount;
+        }
+        
+        for (int id = 0; id < N_TIDY_TAGS; ++id) {
+            if (tagCounts[id] > 0) {
+                statistics.tagCounts[QString::fromUtf8(tagNames[id])] += tagCounts[id];
+            }
+        }
+        
+        return statistics;
+    }
+
+private:
+    void countTag(TidyNode node) {
+        const TidyTagId id = tidyNodeGetId(node);
+        
+        if ((id == TidyTag_UNKNOWN) || (id >= N_TIDY_TAGS)) {
+            ++statistics.tagCounts[QString::fromUtf8(tidyNodeGetName(node))];
+        }
+        else if (tagCounts[id]++ == 0) {
+            tagNames[id] = tidyNodeGetName(node);
+        }
+    }
+    
+    TidyDoc document;
+    TidyBuffer buffer;
+    qint64 depthSum;
+    int tagCounts[N_TIDY_TAGS];
+    ctmbstr tagNames[N_TIDY_TAGS];
+    QHtmlDocumentStatistics statistics;
+};
+
+static QByteArray nodePath(TidyNode node) {
+    QByteArray path;
+    
+    for (TidyNode parent = tidyGetParent(node); parent; node = parent, parent = tidyGetParent(node)) {
+        int index = 0;
+        
+        for (TidyNode sibling = previousSiblingStartNode(node); sibling; sibling = previousSiblingStartNode(sibling)) {
+            ++index;
+        }
+        
+        path.prepend(QByteArray::number(index));
+        path.prepend('/');
+    }
+    
+    return path.isEmpty() ? QByteArray("/") : path;
+}
+
+static QByteArray encodeMatches(const QHtmlAttributeMatches &matches) {
+    QByteArray encoded;
+    
+    foreach (const QHtmlAttributeMatch &match, matches) {
+        if (!encoded.isEmpty()) {
+            encoded += ',';
+        }
+        
+        encoded += QUrl::toPercentEncoding(match.name());
+        encoded += ':';
+        encoded += QUrl::toPercentEncoding(match.value());
+        encoded += ':';
+        encoded += QByteArray::number(int(match.flags()));
+    }
+    
+    return encoded;
+}
+
+static QByteArray queryKey(TidyNode node, const char *function, const QString &name,
+                           const QHtmlAttributeMatches &matches = QHtmlAttributeMatches(), int matchType = -1,
+                           int maxDepth = -1) {
+    // Matches are compared independently of their order.
+    QList<QByteArray> encoded;
+    
+    foreach (const QHtmlAttributeMatch &match, matches) {
+        encoded << encodeMatches(QHtmlAttributeMatches() << match);
+    }
+    
+    qSort(encoded);
+    QByteArray key(reinterpret_cast<const char*>(&node), sizeof(node));
+    key += function;
+    key += '\t';
+    key += name.toUtf8();
+    key += '\t';
+    
+    foreach (const QByteArray &match, encoded) {
+        key += match;
+        key += ',';
+    }
+    
+    key += '\t';
+    key += QByteArray::number(matchType);
+    
+    if (maxDepth >= 0) {
+        key += '\t';
+        key += QByteArray::number(maxDepth);
+    }
+    
+    return key;
+}
+
+class QHtmlRecorder
+{
+
+public:
+    QHtmlRecorder() :
+        device(0),
+        mode(QHtmlParser::RecordContentHash)
+    {
+    }
+    
+    bool isActive() const {
+        return (instrumentationSinks() & RecorderSink) != 0;
+    }
+    
+    bool start(QIODevice *dev, QHtmlParser::RecordingMode m) {
+        QMutexLocker locker(&mutex);
+        
+        if ((!dev) || (!dev->isWritable())) {
+            return false;
+        }
+        
+        // Any active recording is stopped first, so its device is no longer written to.
+        setSinkActive(RecorderSink, false);
+        device = dev;
+        mode = m;
+        device->write("qhtmlparser-recording\t1\n");
+        setSinkActive(RecorderSink, true);
+        return true;
+    }
+    
+    void stop() {
+        QMutexLocker locker(&mutex);
+        setSinkActive(RecorderSink, false);
+        device = 0;
+    }
+    
+    void recordDocument(int id, const QByteArray &content, const QString &path) {
+        mutex.lock();
+        const QHtmlParser::RecordingMode m = mode;
+        mutex.unlock();
+        QList<QByteArray> fields;
+        fields << "document" << QByteArray::number(id)
+               << QCryptographicHash::hash(content, QCryptographicHash::Sha1).toHex()
+               << QByteArray::number(content.size()) << QUrl::toPercentEncoding(path);
+        
+        if (m == QHtmlParser::RecordContent) {
+            fields << content.toBase64();
+        }
+        
+        write(fields);
+    }
+    
+    void recordRelease(int id) {
+        write(QList<QByteArray>() << "release" << QByteArray::number(id));
+    }
+    
+    void recordOptions(int id, bool queryCache, bool attributeIndex, bool textIndex,
+                       const QList<QByteArray> &valueIndexedAttributes) {
+        QByteArray names;
+        
+        foreach (const QByteArray &name, valueIndexedAttributes) {
+            if (!names.isEmpty()) {
+                names += ',';
+            }
+            
+            names += QUrl::toPercentEncoding(QString::fromUtf8(name));
+        }
+        
+        write(QList<QByteArray>() << "options" << QByteArray::number(id) << QByteArray::number(int(queryCache))
+              << QByteArray::number(int(attributeIndex)) << QByteArray::number(int(textIndex)) << names);
+    }
+    
+    void recordQuery(int id, TidyNode node, const char *function, const QList<QByteArray> &args) {
+        write(QList<QByteArray>() << "query" << QByteArray::number(id) << nodePath(node) << function << args);
+    }
+    
+private:
+    void write(const QList<QByteArray> &fields) {
+        QByteArray line;
+        
+        foreach (const QByteArray &field, fields) {
+            if (!line.isEmpty()) {
+                line += '\t';
+            }
+            
+            line += field;
+        }
+        
+        line += '\n';
+        QMutexLocker locker(&mutex);
+        
+        if (device) {
+            device->write(line);
+        }
+    }
+    
+    QMutex mutex;
+    QIODevice *device;
+    QHtmlParser::RecordingMode mode;
+};
+
+Q_GLOBAL_STATIC(QHtmlRecorder, recorder)
+
+class QHtmlTracer
+{
+
+public:
+    QHtmlTracer() :
+        device(0),
+        sessionStart(0),
+        events(0)
+    {
+        clock.start();
+    }
+    
+    bool isActive() const {
+        return (instrumentationSinks() & TracerSink) != 0;
+    }
+    
+    bool start(QIODevice *dev) {
+        QMutexLocker locker(&mutex);
+        
+        if ((!dev) || (!dev->isWritable())) {
+            return false;
+        }
+        
+        // Any active trace is terminated first, so that it remains valid JSON.
+        if (device) {
+            device->write("\n]\n");
+        }
+        
+        device = dev;
+        events = 0;
+        // The clock is never restarted, so that scopes opened during a previous trace can be recognised.
+        sessionStart = clock.nsecsElapsed();
+        device->write("[\n");
+        setSinkActive(TracerSink, true);
+        return true;
+    }
+    
+    void stop() {
+        QMutexLocker locker(&mutex);
+        setSinkActive(TracerSink, false);
+        
+        if (device) {
+            device->write("\n]\n");
+            device = 0;
+        }
+    }
+    
+    qint64 timestamp() const {
+        return clock.nsecsElapsed();
+    }
+    
+    void addEvent(const char *name, const char *category, qint64 start, int document, const QByteArray &args) {
+        QByteArray event("{\"name\":\"");
+        event += name;
+        event += "\",\"cat\":\"";
+        event += category;
+        event += "\",\"ph\":\"X\",\"pid\":";
+        event += QByteArray::number(QCoreApplication::applicationPid());
+        event += ",\"tid\":";
+        event += QByteArray::number(quint64(quintptr(QThread::currentThreadId())));
+        event += ",\"args\":{\"document\":";
+        event += QByteArray::number(document);
+        
+        if (!args.isEmpty()) {
+            event += ',';
+            event += args;
+        }
+        
+        QMutexLocker locker(&mutex);
+        
+        if ((!device) || (start < sessionStart)) {
+            return;
+        }
+        
+        const qint64 end = clock.nsecsElapsed();
+        event += "},\"ts\":";
+        event += QByteArray::number((start - sessionStart) / 1000.0, 'f', 3);
+        event += ",\"dur\":";
+        event += QByteArray::number((end - start) / 1000.0, 'f', 3);
+        event += '}';
+        
+        if (events++ > 0) {
+            device->write(",\n");
+        }
+        
+        device->write(event);
+    }
+    
+private:
+    QMutex mutex;
+    QIODevice *device;
+    QElapsedTimer clock;
+    qint64 sessionStart;
+    qint64 events;
+};
+
+Q_GLOBAL_STATIC(QHtmlTracer, tracer)
+
+// Writes a trace event for building an index of a document, if tracing is active.
+class IndexTraceScope
+{
+
+public:
+    IndexTraceScope(int id, const char *n) :
+        entries(0),
+        document(id),
+        name(n),
+        traceStart(tracer()->isActive() ? tracer()->timestamp() : -1)
+    {
+    }
+    
+    ~IndexTraceScope() {
+        if (traceStart >= 0) {
+            tracer()->addEvent(name, "index", traceStart, document, "\"entries\":" + QByteArray::number(entries));
+        }
+    }
+    
+    int entries;
+    
+private:
+    int document;
+    const char *name;
+    qint64 traceStart;
+};
+
+class QHtmlSlowDocumentMonitor
+{
+
+public:
+    QHtmlSlowDocumentMonitor() :
+        handler(0),
+        userData(0)
+    {
+    }
+    
+    bool isActive() const {
+        return (instrumentationSinks() & MonitorSink) != 0;
+    }
+    
+    void setHandler(QHtmlParser::SlowDocumentHandler h, const QHtmlSlowDocumentLimits &l, void *data) {
+        QMutexLocker locker(&mutex);
+        handler = h;
+        limitValues = l;
+        userData = data;
+        setSinkActive(MonitorSink, h != 0);
+    }
+    
+    QHtmlSlowDocumentLimits limits() {
+        QMutexLocker locker(&mutex);
+        return limitValues;
+    }
+    
+    void notify(const QHtmlSlowDocumentEvent &event) {
+        mutex.lock();
+        const QHtmlParser::SlowDocumentHandler h = handler;
+        void *data = userData;
+        mutex.unlock();
+        
+        if (h) {
+            h(event, data);
+        }
+    }
+    
+private:
+    QMutex mutex;
+    QHtmlParser::SlowDocumentHandler handler;
+    QHtmlSlowDocumentLimits limitValues;
+    void *userData;
+};
+
+Q_GLOBAL_STATIC(QHtmlSlowDocumentMonitor, monitor)
+
+#if QT_VERSION >= 0x050300
+typedef QAtomicInteger<qint64> MetricCounter;
+#else
+// QAtomicInt is only 32 bits wide, which nanosecond sums and byte totals soon overflow.
+class MetricCounter
+{
+
+public:
+    MetricCounter() :
+        value(0)
+    {
+    }
+    
+    void fetchAndAddRelaxed(qint64 delta) {
+        QMutexLocker locker(&mutex);
+        value += delta;
+    }
+    
+    qint64 load() const {
+        QMutexLocker locker(&mutex);
+        return value;
+    }
+    
+private:
+    mutable QMutex mutex;
+    qint64 value;
+};
+#endif
+
+static inline qint64 metricValue(const MetricCounter &counter) {
+#if QT_VERSION >= 0x050300
+    return counter.loadAcquire();
+#else
+    return counter.load();
+#endif
+}
+
+static const qint64 latencyBuckets[] = { 100000, 500000, 1000000, 5000000, 10000000, 50000000, 100000000,
+                                          500000000, 1000000000 };
+static const int latencyBucketCount = sizeof(latencyBuckets) / sizeof(latencyBuckets[0]);
+
+static const char *const queryFunctions[] = { "elementById", "elementsByTagName", "firstElementByTagName",
+                                              "lastElementByTagName", "nthElementByTagName", "countElementsByTagName",
+                                              "hasElementByTagName", "childElementsByTagName", "nextSiblingByTagName",
+                                              "previousSiblingByTagName", "closest", "elementsWithAttribute",
+                                              "elementsContainingText", "findText", "other" };
+static const int queryFunctionCount = sizeof(queryFunctions) / sizeof(queryFunctions[0]);
+
+enum ParseErrorClass {
+    TidyParseError = 0,
+    FatalParseError,
+    DeviceParseError
+};
+
+static const char *const parseErrorClasses[] = { "tidy", "fatal", "device" };
+static const int parseErrorClassCount = sizeof(parseErrorClasses) / sizeof(parseErrorClasses[0]);
+
+class MetricHistogram
+{
+
+public:
+    void observe(qint64 nsecs) {
+        int i = 0;
+        
+        while ((i < latencyBucketCount) && (nsecs > latencyBuckets[i])) {
+            ++i;
+        }
+        
+        buckets[i].fetchAndAddRelaxed(1);
+        sum.fetchAndAddRelaxed(nsecs);
+    }
+    
+    void write(QByteArray &out, const char *name, const QByteArray &labels) const {
+        const QByteArray prefix = QByteArray(name) + "_bucket{" + labels + (labels.isEmpty() ? "" : ",") + "le=\"";
+        qint64 count = 0;
+        
+        for (int i = 0; i <= latencyBucketCount; ++i) {
+            count += metricValue(buckets[i]);
+            out += prefix;
+            out += (i < latencyBucketCount ? QByteArray::number(latencyBuckets[i] / 1000000000.0) : QByteArray("+Inf"));
+            out += "\"} " + QByteArray::number(count) + "\n";
+        }
+        
+        const QByteArray suffix = (labels.isEmpty() ? QByteArray() : "{" + labels + "}");
+        out += QByteArray(name) + "_sum" + suffix + " " + QByteArray::number(metricValue(sum) / 1000000000.0, 'g', 9)
+               + "\n";
+        out += QByteArray(name) + "_count" + suffix + " " + QByteArray::number(count) + "\n";
+    }
+    
+private:
+    MetricCounter buckets[latencyBucketCount + 1];
+    MetricCounter sum;
+};
+
+class QHtmlMetrics
+{
+
+public:
+    bool isActive() const {
+        return (instrumentationSinks() & MetricsSink) != 0;
+    }
+    
+    void setActive(bool enabled) {
+        setSinkActive(MetricsSink, enabled);
+    }
+    
+    void parsed(qint64 bytes, qint64 nsecs) {
+        documents.fetchAndAddRelaxed(1);
+        bytesParsed.fetchAndAddRelaxed(bytes);
+        parseLatency.observe(nsecs);
+    }
+    
+    void parseError(ParseErrorClass errorClass) {
+        parseErrors[errorClass].fetchAndAddRelaxed(1);
+    }
+    
+    void queried(const char *function, qint64 nsecs) {
+        int i = 0;
+        
+        while ((i < queryFunctionCount - 1) && (qstrcmp(function, queryFunctions[i]) != 0)) {
+            ++i;
+        }
+        
+        queryLatency[i].observe(nsecs);
+    }
+    
+    QByteArray text() const {
+        QByteArray out;
+        out += "# HELP qhtmlparser_documents_parsed_total Number of documents parsed.\n";
+        out += "# TYPE qhtmlparser_documents_parsed_total counter\n";
+        out += "qhtmlparser_documents_parsed_total " + QByteArray::number(metricValue(documents)) + "\n";
+        out += "# HELP qhtmlparser_bytes_parsed_total Number of bytes of document content parsed.\n";
+        out += "# TYPE qhtmlparser_bytes_parsed_total counter\n";
+        out += "qhtmlparser_bytes_parsed_total " + QByteArray::number(metricValue(bytesParsed)) + "\n";
+        out += "# HELP qhtmlparser_parse_errors_total Number of documents that failed to parse, by error class.\n";
+        out += "# TYPE qhtmlparser_parse_errors_total counter\n";
+        
+        for (int i = 0; i < parseErrorClassCount; ++i) {
+            out += "qhtmlparser_parse_errors_total{class=\"" + QByteArray(parseErrorClasses[i]) + "\"} "
+                   + QByteArray::number(metricValue(parseErrors[i])) + "\n";
+        }
+        
+        out += "# HELP qhtmlparser_parse_duration_seconds Time spent parsing documents.\n";
+        out += "# TYPE qhtmlparser_parse_duration_seconds histogram\n";
+        parseLatency.write(out, "qhtmlparser_parse_duration_seconds", QByteArray());
+        out += "# HELP qhtmlparser_query_duration_seconds Time spent in queries, by function.\n";
+        out += "# TYPE qhtmlparser_query_duration_seconds histogram\n";
+        
+        for (int i = 0; i < queryFunctionCount; ++i) {
+            queryLatency[i].write(out, "qhtmlparser_query_duration_seconds",
+                                  "function=\"" + QByteArray(queryFunctions[i]) + "\"");
+        }
+        
+        return out;
+    }
+    
+private:
+    MetricCounter documents;
+    MetricCounter bytesParsed;
+    MetricCounter parseErrors[parseErrorClassCount];
+    MetricHistogram parseLatency;
+    MetricHistogram queryLatency[queryFunctionCount];
+};
+
+Q_GLOBAL_STATIC(QHtmlMetrics, metrics)
+
+static const int maxCachedQueries = 1024;
+
+// Output buffers that grow larger than this are released after rendering instead of being reused.
+static const uint maxRetainedOutput = 1024 * 1024;
+
+// Owns the output buffer reused by the renders made from one thread.
+struct RenderBuffer
+{
+    RenderBuffer() :
+        buffer(TidyBuffer())
+    {
+    }
+    
+    ~RenderBuffer() {
+        tidyBufFree(&buffer);
+    }
+    
+    TidyBuffer buffer;
+};
+
+static QThreadStorage<RenderBuffer*> renderBuffers;
+
+struct ValueIndexEntry
+{
+    QString value;
+    int position;
+};
+
+static inline bool operator<(const ValueIndexEntry &a, const ValueIndexEntry &b) {
+    return (a.value < b.value) || ((a.value == b.value) && (a.position < b.position));
+}
+
+static inline bool valueLessThan(const ValueIndexEntry &entry, const QString &value) {
+    return entry.value < value;
+}
+
+static QAtomicInt documentCounter;
+
+class QHtmlDocumentPrivate
+{
+
+public:
+    QHtmlDocumentPrivate() :
+        document(0),
+        id(0),
+        generation(0),
+        error(false),
+        queryCacheEnabled(false),
+        queryResults(maxCachedQueries),
+        attributeIndexEnabled(false),
+        attributeIndexBuilt(false),
+        valueIndexesBuilt(false),
+        textIndexEnabled(false),
+        textIndexBuilt(false)
+    {
+    }
+    
+    ~QHtmlDocumentPrivate() {
+        release();
+    }
+    
+    void release() {
+        QMutexLocker locker(&mutex);
+        ++generation;
+        queryResults.clear();
+        hashes.clear();
+        orderedNodes.clear();
+        subtreeEnds.clear();
+        nodeIndices.clear();
+        attributeIndex.clear();
+        attributeIndexBuilt = false;
+        valueIndexes.clear();
+        valueIndexesBuilt = false;
+        clearTextIndex();
+        locker.unlock();
+        
+        if (document) {
+            tidyRelease(document);
+            document = 0;
+            
+            if (recorder()->isActive()) {
+                recorder()->recordRelease(id);
+            }
+        }
+    }
+    
+    bool setContent(const QByteArray &content, const QString &path = QString()) {
+        release();
+        id = documentCounter.fetchAndAddRelaxed(1) + 1;
+        document = tidyCreate();
+        tidySetAppData(document, this);
+        tidySetCharEncoding(document, "utf8");
+        tidyOptSetBool(document, TidyForceOutput, yes);
+        tidyOptSetInt(document, TidyWrapLen, 0);
+        tidyOptSetBool(document, TidyQuiet, yes);
+        tidyOptSetBool(document, TidyShowWarnings, no);
+        
+        TidyBuffer errorBuffer = TidyBuffer();
+        tidySetErrorBuffer(document, &errorBuffer);
+        QHTMLPARSER_PROBE2(parse__start, id, content.size());
+        const int sinks = instrumentationSinks();
+        const qint64 traceStart = ((sinks & TracerSink) ? tracer()->timestamp() : -1);
+#ifdef QHTMLPARSER_STATS
+        const bool timed = true;
+#else
+        const bool timed = (sinks & (MonitorSink | MetricsSink)) != 0;
+#endif
+        QElapsedTimer timer;
+        
+        if (timed) {
+            timer.start();
+        }
+        
+        const int result = tidyParseString(document, content.constData());
+        const qint64 parseTime = (timed ? timer.nsecsElapsed() : 0);
+        stats = QHtmlParserStats();
+#ifdef QHTMLPARSER_STATS
+        stats.parseTime = parseTime;
+        stats.bytes = content.size();
+        countNodes(tidyGetRoot(document), 1, stats.nodeCount, stats.maxDepth);
+#endif
+        error = tidyErrorCount(document) > 0;
+        
+        if (sinks & MetricsSink) {
+            metrics()->parsed(content.size(), parseTime);
+            
+            if (result < 0) {
+                metrics()->parseError(FatalParseError);
+            }
+            else if (error) {
+                metrics()->parseError(TidyParseError);
+            }
+        }
+        
+        if (QHTMLPARSER_PROBE_ENABLED(parse__done)) {
+            int nodeCount = 0;
+            int maxDepth = 0;
+            countNodes(tidyGetRoot(document), 1, nodeCount, maxDepth);
+            QHTMLPARSER_PROBE4(parse__done, id, content.size(), nodeCount, int(error));
+        }
+        
+        if (traceStart >= 0) {
+            tracer()->addEvent("parse", "parse", traceStart, id, "\"bytes\":" + QByteArray::number(content.size())
+                               + ",\"error\":" + (error ? "true" : "false"));
+        }
+        
+        if (error) {
+            errorString = QString::fromUtf8((char*)errorBuffer.bp);
+            tidyBufFree(&errorBuffer);
+        }
+        else {
+            errorString = QString();
+        }
+        
+        if (sinks & RecorderSink) {
+            recorder()->recordDocument(id, content, path);
+            recordOptions();
+        }
+        
+        source.clear();
+        
+        if (sinks & MonitorSink) {
+            checkParse(content, parseTime);
+        }
+        
+        return !error;
+    }
+    
+    void checkParse(const QByteArray &content, qint64 parseTime) {
+        const QHtmlSlowDocumentLimits limits = monitor()->limits();
+#ifndef QHTMLPARSER_STATS
+        stats.parseTime = parseTime;
+        stats.bytes = content.size();
+        
+        if ((limits.nodeCount > 0) || (limits.maxDepth > 0)) {
+            countNodes(tidyGetRoot(document), 1, stats.nodeCount, stats.maxDepth);
+        }
+#endif
+        if (limits.includeContent) {
+            source = QByteArray(content.constData(), content.size());
+        }
+        
+        QHtmlSlowDocumentEvent event;
+        
+        if ((limits.parseTime > 0) && (parseTime > limits.parseTime)) {
+            event.reasons |= QHtmlParser::SlowParse;
+        }
+        
+        if ((limits.nodeCount > 0) && (stats.nodeCount > limits.nodeCount)) {
+            event.reasons |= QHtmlParser::TooManyNodes;
+        }
+        
+        if ((limits.maxDepth > 0) && (stats.maxDepth > limits.maxDepth)) {
+            event.reasons |= QHtmlParser::TooDeep;
+        }
+        
+        if (event.reasons) {
+            event.documentId = id;
+            event.stats = stats;
+            event.content = source;
+            monitor()->notify(event);
+        }
+    }
+    
+    bool isQueryCacheEnabled() {
+        QMutexLocker locker(&mutex);
+        return queryCacheEnabled;
+    }
+    
+    // Records the query options, so that a replay builds the same indexes before running the queries.
+    void recordOptions() {
+        if ((!document) || (!recorder()->isActive())) {
+            return;
+        }
+        
+        mutex.lock();
+        const bool queryCache = queryCacheEnabled;
+        const bool attributeIndex = attributeIndexEnabled;
+        const bool textIndex = textIndexEnabled;
+        const QList<QByteArray> names = valueIndexedAttributes;
+        mutex.unlock();
+        recorder()->recordOptions(id, queryCache, attributeIndex, textIndex, names);
+    }
+    
+    bool cachedQuery(const QByteArray &key, QHtmlElementList &elements) {
+        QMutexLocker locker(&mutex);
+        const QHtmlElementList *cached = queryResults.object(key);
+        
+        if (!cached) {
+            return false;
+        }
+        
+        elements = *cached;
+        return true;
+    }
+    
+    // Stores the result of a query, evicting the least recently used result once the cache is full.
+    void cacheQuery(const QByteArray &key, const QHtmlElementList &elements) {
+        QMutexLocker locker(&mutex);
+        
+        if (queryCacheEnabled) {
+            queryResults.insert(key, new QHtmlElementList(elements));
+        }
+    }
+    
+    // Indexes the position of each element in document order, if not already done.
+    void ensureOrderIndex() {
+        QMutexLocker locker(&mutex);
+        
+        if ((document) && (orderedNodes.isEmpty())) {
+            IndexTraceScope scope(id, "orderIndex");
+            const TidyNode root = tidyGetRoot(document);
+            orderedNodes << root;
+            subtreeEnds << 0;
+            nodeIndices.insert(root, 0);
+            indexNodes(root);
+            subtreeEnds[0] = orderedNodes.size() - 1;
+            scope.entries = orderedNodes.size();
+        }
+    }
+    
+    // Indexes the position of each element by the names of its attributes, if not already done.
+    void ensureAttributeIndex() {
+        ensureOrderIndex();
+        QMutexLocker locker(&mutex);
+        
+        if ((attributeIndexEnabled) && (!attributeIndexBuilt)) {
+            IndexTraceScope scope(id, "attributeIndex");
+            
+            for (int i = 0; i < orderedNodes.size(); ++i) {
+                for (TidyAttr attr = tidyAttrFirst(orderedNodes.at(i)); attr; attr = tidyAttrNext(attr)) {
+                    QVector<int> &positions = attributeIndex[QByteArray(tidyAttrName(attr))];
+                    
+                    if ((positions.isEmpty()) || (positions.last() != i)) {
+                        positions << i;
+                        ++scope.entries;
+                    }
+                }
+            }
+            
+            attributeIndexBuilt = true;
+        }
+    }
+    
+    // Builds the value index of each value-indexed attribute, if not already done.
+    void ensureValueIndexes() {
+        ensureOrderIndex();
+        QMutexLocker locker(&mutex);
+        
+        if (valueIndexesBuilt) {
+            return;
+        }
+        
+        IndexTraceScope scope(id, "valueIndex");
+        
+        foreach (const QByteArray &name, valueIndexedAttributes) {
+            QVector<ValueIndexEntry> &entries = valueIndexes[name];
+            
+            for (int i = 0; i < orderedNodes.size(); ++i) {
+                for (TidyAttr attr = tidyAttrFirst(orderedNodes.at(i)); attr; attr = tidyAttrNext(attr)) {
+                    if (qstrcmp(tidyAttrName(attr), name.constData()) == 0) {
+                        const ctmbstr value = tidyAttrValue(attr);
+                        
+                        if (value) {
+                            ValueIndexEntry entry;
+                            entry.value = QString::fromUtf8(value).toCaseFolded();
+                            entry.position = i;
+                            entries << entry;
+                        }
+                        
+                        break;
+                    }
+                }
+            }
+            
+            std::sort(entries.begin(), entries.end());
+            scope.entries += entries.size();
+        }
+        
+        valueIndexesBuilt = true;
+    }
+    
+    // Indexes the tokens of the text of the document, if enabled and not already done.
+    void ensureTextIndex() {
+        QMutexLocker locker(&mutex);
+        
+        if ((document) && (textIndexEnabled) && (!textIndexBuilt)) {
+            IndexTraceScope scope(id, "textIndex");
+            TextIndexSink sink(tokenIds, tokenPostings, tokenSequence, tokenNodes);
+            tokenizeText(document, tidyGetRoot(document), sink);
+            scope.entries = tokenSequence.size();
+            textIndexBuilt = true;
+        }
+    }
+    
+    void clearTextIndex() {
+        tokenIds.clear();
+        tokenPostings.clear();
+        tokenSequence.clear();
+        tokenNodes.clear();
+        textIndexBuilt = false;
+    }
+    
+    /*
+     * Returns the innermost element that encloses both text nodes, which are in document order, or 0 if 
+     * they are not in the order index. Must be called with the mutex locked, as the order index is 
+     * discarded when the content is set.
+     */
+    TidyNode enclosingElement(TidyNode first, TidyNode last) const {
+        const int end = nodeIndices.value(tidyGetParent(last), -1);
+        
+        if (end < 0) {
+            return 0;
+        }
+        
+        for (TidyNode node = tidyGetParent(first); node; node = tidyGetParent(node)) {
+            const int index = nodeIndices.value(node, -1);
+            
+            if ((index >= 0) && (index <= end) && (subtreeEnds.at(index) >= end)) {
+                return node;
+            }
+        }
+        
+        return 0;
+    }
+    
+    void indexNodes(TidyNode node) {
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            if (isStartNode(child)) {
+                const int index = orderedNodes.size();
+                orderedNodes << child;
+                subtreeEnds << index;
+                nodeIndices.insert(child, index);
+                indexNodes(child);
+                subtreeEnds[index] = orderedNodes.size() - 1;
+            }
+            else {
+                indexNodes(child);
+            }
+        }
+    }
+    
+    quint64 contentHash(TidyNode node) {
+        QMutexLocker locker(&mutex);
+        TidyBuffer buffer = TidyBuffer();
+        const quint64 hash = nodeHash(node, buffer);
+        tidyBufFree(&buffer);
+        return hash;
+    }
+    
+    // Must be called with the mutex locked.
+    quint64 nodeHash(TidyNode node, TidyBuffer &buffer) {
+        const QHash<TidyNode, quint64>::const_iterator iterator = hashes.constFind(node);
+        
+        if (iterator != hashes.constEnd()) {
+            return iterator.value();
+        }
+        
+        const TidyNodeType type = tidyNodeGetType(node);
+        quint64 hash = hashBytes(0, 0, type);
+        
+        if ((type == TidyNode_Start) || (type == TidyNode_StartEnd)) {
+            const ctmbstr name = tidyNodeGetName(node);
+            hash = hashBytes(name, qstrlen(name), hash);
+            
+            for (TidyAttr attr = tidyAttrFirst(node); attr; attr = tidyAttrNext(attr)) {
+                const ctmbstr attrName = tidyAttrName(attr);
+                const ctmbstr attrValue = tidyAttrValue(attr);
+                hash = hashBytes(attrName, qstrlen(attrName), hash);
+                hash = (attrValue ? hashBytes(attrValue, qstrlen(attrValue), hash) : hashBytes(0, 0, ~hash));
+            }
+        }
+        else if (type != TidyNode_Root) {
+            tidyBufClear(&buffer);
+            
+            if (tidyNodeGetValue(document, node, &buffer)) {
+                hash = hashBytes((const char*)buffer.bp, buffer.size, hash);
+            }
+        }
+        
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            const quint64 childHash = qToLittleEndian(nodeHash(child, buffer));
+            hash = hashBytes(reinterpret_cast<const char*>(&childHash), sizeof(childHash), hash);
+        }
+        
+        if ((type == TidyNode_Start) || (type == TidyNode_StartEnd) || (type == TidyNode_Root)) {
+            hashes.insert(node, hash);
+        }
+        
+        return hash;
+    }
+    
+#ifdef QHTMLPARSER_STATS
+    void addQuery(const QHtmlQueryStats &query, qint64 elapsed) {
+        QMutexLocker locker(&statsMutex);
+        ++stats.queryCount;
+        stats.queries.nodesVisited += query.nodesVisited;
+        stats.queries.predicatesEvaluated += query.predicatesEvaluated;
+        stats.queries.matches += query.matches;
+        stats.queries.elapsed += elapsed;
+    }
+    
+    void addRender(qint64 elapsed) {
+        QMutexLocker locker(&statsMutex);
+        ++stats.renderCount;
+        stats.renderTime += elapsed;
+    }
+#endif
+    
+    void checkQuery(const char *function, const QHtmlQueryStats &query) {
+        const QHtmlSlowDocumentLimits limits = monitor()->limits();
+        
+        if ((limits.queryTime > 0) && (query.elapsed > limits.queryTime)) {
+            QHtmlSlowDocumentEvent event;
+            event.reasons = QHtmlParser::SlowQuery;
+            event.documentId = id;
+            event.function = function;
+            statsMutex.lock();
+            event.stats = stats;
+            statsMutex.unlock();
+            event.query = query;
+            event.content = source;
+            monitor()->notify(event);
+        }
+    }
+    
+    TidyDoc document;
+    int id;
+    
+    // Incremented each time the content is released, so that positions in the order index can be 
+    // checked against the parse they were taken from.
+    int generation;
+    
+    bool error;
+    QString errorString;
+    
+    // Guards stats on its own, so that queries merging their counters never wait for an index build.
+    QMutex statsMutex;
+    QHtmlParserStats stats;
+    QByteArray source;
+    
+    bool queryCacheEnabled;
+    QCache<QByteArray, QHtmlElementList> queryResults;
+    QHash<TidyNode, quint64> hashes;
+    
+    QVector<TidyNode> orderedNodes;
+    QVector<int> subtreeEnds;
+    QHash<TidyNode, int> nodeIndices;
+    
+    bool attributeIndexEnabled;
+    bool attributeIndexBuilt;
+    QHash<QByteArray, QVector<int> > attributeIndex;
+    
+    QList<QByteArray> valueIndexedAttributes;
+    bool valueIndexesBuilt;
+    QHash<QByteArray, QVector<ValueIndexEntry> > valueIndexes;
+    
+    bool textIndexEnabled;
+    bool textIndexBuilt;
+    QHash<QByteArray, int> tokenIds;
+    QVector< QVector<int> > tokenPostings;
+    QVector<int> tokenSequence;
+    QVector<TidyNode> tokenNodes;
+    
+    QMutex mutex;
+    
+    // Tidy's printer keeps its state in the document, so only one thread may render it at a time.
+    QMutex printMutex;
+};
+
+class QHtmlElementPrivate
+{
+
+public:
+    QHtmlElementPrivate() :
+        document(0),
+        node(0)
+    {
+    }
+    
+    ~QHtmlElementPrivate() {}    
+    
+    TidyDoc document;
+    TidyNode node;
+};
+
+static QHtmlDocumentPrivate* documentPrivate(TidyDoc document) {
+    return static_cast<QHtmlDocumentPrivate*>(tidyGetAppData(document));
+}
+
+static void recordQuery(const QHtmlElementPrivate *d, const char *function, const QList<QByteArray> &args) {
+    recorder()->recordQuery(documentPrivate(d->document)->id, d->node, function, args);
+}
+
+struct QueryPlan
+{
+    QueryPlan() :
+        strategy(QHtmlParser::FullScan),
+        firstNode(0),
+        lastNode(0)
+    {
+    }
+    
+    QHtmlParser::QueryStrategy strategy;
+    // The candidate elements in document order, unless the strategy is FullScan.
+    QList<TidyNode> nodes;
+    // The first and last elements below the scope, unless the strategy is FullScan.
+    TidyNode firstNode;
+    TidyNode lastNode;
+};
+
+/*
+ * Sets first and last to the range of positions in the attribute index of the elements below 
+ * scope with the attribute name. Returns false if scope is not indexed. Must be called with the 
+ * mutex of the document locked, as the index may be discarded by another thread.
+ */
+static bool indexedRange(QHtmlDocumentPrivate *dp, TidyNode scope, const QByteArray &name,
+                         QVector<int>::const_iterator &first, QVector<int>::const_iterator &last) {
+    const int index = dp->nodeIndices.value(scope, -1);
+    
+    if (index < 0) {
+        return false;
+    }
+    
+    const QHash<QByteArray, QVector<int> >::const_iterator iterator = dp->attributeIndex.constFind(name);
+    
+    if (iterator == dp->attributeIndex.constEnd()) {
+        first = last = QVector<int>::const_iterator();
+        return true;
+    }
+    
+    const QVector<int> &positions = iterator.value();
+    first = std::upper_bound(positions.constBegin(), positions.constEnd(), index);
+    last = std::upper_bound(first, positions.constEnd(), dp->subtreeEnds.at(index));
+    return true;
+}
+
+/*
+ * Sets nodes to the elements below scope with the attribute name, in document order. Returns false 
+ * if the attribute index is not enabled.
+ */
+static bool indexedNodes(QHtmlDocumentPrivate *dp, TidyNode scope, const QByteArray &name, QList<TidyNode> &nodes) {
+    dp->mutex.lock();
+    const bool enabled = dp->attributeIndexEnabled;
+    dp->mutex.unlock();
+    
+    if (!enabled) {
+        return false;
+    }
+    
+    dp->ensureAttributeIndex();
+    QMutexLocker locker(&dp->mutex);
+    QVector<int>::const_iterator first;
+    QVector<int>::const_iterator last;
+    
+    if ((!dp->attributeIndexBuilt) || (!indexedRange(dp, scope, name, first, last))) {
+        return false;
+    }
+    
+    nodes.reserve(last - first);
+    
+    for (; first != last; ++first) {
+        nodes << dp->orderedNodes.at(*first);
+    }
+    
+    return true;
+}
+
+/*
+ * Sets candidates to the positions of the elements below scope whose value of the attribute of 
+ * match may satisfy match, in document order. Returns false if the value index cannot be used. 
+ * Must be called with the mutex of the document locked.
+ */
+static bool valueCandidates(QHtmlDocumentPrivate *dp, TidyNode scope, const QHtmlAttributeMatch &match,
+                            QVector<int> &candidates) {
+    // Uses the same precedence of flags as matchAttribute().
+    const bool exact = match.testFlag(QHtmlParser::MatchExactly);
+    
+    if ((!exact) && ((match.testFlag(QHtmlParser::MatchContains)) || (!match.testFlag(QHtmlParser::MatchStartsWith)))) {
+        return false;
+    }
+    
+    const QHash<QByteArray, QVector<ValueIndexEntry> >::const_iterator iterator =
+        dp->valueIndexes.constFind(match.name().toUtf8());
+    const int index = dp->nodeIndices.value(scope, -1);
+    
+    if ((iterator == dp->valueIndexes.constEnd()) || (index < 0)) {
+        return false;
+    }
+    
+    // The index holds case-folded values, so it finds a superset of the case-sensitive matches.
+    const QVector<ValueIndexEntry> &entries = iterator.value();
+    const QString value = match.value().toCaseFolded();
+    const int end = dp->subtreeEnds.at(index);
+    candidates.clear();
+    
+    for (QVector<ValueIndexEntry>::const_iterator entry = std::lower_bound(entries.constBegin(), entries.constEnd(),
+                                                                            value, valueLessThan);
+         (entry != entries.constEnd()) && (exact ? entry->value == value : entry->value.startsWith(value)); ++entry) {
+        if ((entry->position > index) && (entry->position <= end)) {
+            candidates << entry->position;
+        }
+    }
+    
+    std::sort(candidates.begin(), candidates.end());
+    return true;
+}
+
+#if QT_VERSION >= 0x050000
+struct TextMatchResult
+{
+    TidyNode node;
+    int offset;
+    int length;
+    QStringList capturedTexts;
+};
+
+/*
+ * Matches a regular expression against each run of text nodes separated only by inline elements. 
+ * Offsets are counted over all text nodes visited, so the offset of a match within an element is 
+ * its offset less the offset at which the element was entered.
+ */
+template <typename Counters>
+class TextMatcher
+{
+
+public:
+    TextMatcher(QHtmlDocumentPrivate *dp, const QRegularExpression &regExp, Counters &counters) :
+        dp(dp),
+        regExp(regExp),
+        counters(counters),
+        buffer(TidyBuffer()),
+        position(0)
+    {
+    }
+    
+    ~TextMatcher() {
+        tidyBufFree(&buffer);
+    }
+    
+    void match(TidyNode scope) {
+        dp->ensureOrderIndex();
+        entryOffsets.insert(scope, 0);
+        walk(scope);
+        flush();
+    }
+    
+    QList<TextMatchResult> results;
+
+private:
+    void walk(TidyNode node) {
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            switch (tidyNodeGetType(child)) {
+            case TidyNode_Text:
+                counters.visit();
+                tidyBufClear(&buffer);
+                
+                if ((tidyNodeGetValue(dp->document, child, &buffer)) && (buffer.size > 0)) {
+                    runNodes << child;
+                    runOffsets << run.size();
+                    run += QString::fromUtf8((char*)buffer.bp, buffer.size);
+                }
+                
+                break;
+            case TidyNode_Start:
+            case TidyNode_StartEnd:
+                if (!isScriptOrStyle(child)) {
+                    const bool inlineElement = isInline(child);
+                    
+                    if (!inlineElement) {
+                        flush();
+                    }
+                    
+                    entryOffsets.insert(child, position + run.size());
+                    walk(child);
+                    
+                    if (!inlineElement) {
+                        flush();
+                    }
+                }
+                
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    
+    void flush() {
+        if (run.isEmpty()) {
+            return;
+        }
+        
+        QRegularExpressionMatchIterator iterator = regExp.globalMatch(run);
+        
+        while (iterator.hasNext()) {
+            const QRegularExpressionMatch match = iterator.next();
+            
+            if (match.capturedLength() == 0) {
+                continue;
+            }
+            
+            TextMatchResult result;
+            dp->mutex.lock();
+            result.node = dp->enclosingElement(runNodes.at(nodeAt(match.capturedStart())),
+                                               runNodes.at(nodeAt(match.capturedEnd() - 1)));
+            dp->mutex.unlock();
+            
+            if (!result.node) {
+                continue;
+            }
+            
+            result.offset = position + match.capturedStart() - entryOffsets.value(result.node);
+            result.length = match.capturedLength();
+            result.capturedTexts = match.capturedTexts();
+            results << result;
+            counters.match();
+        }
+        
+        position += run.size();
+        run.resize(0);
+        runNodes.resize(0);
+        runOffsets.resize(0);
+    }
+    
+    // Returns the index of the text node of the run that contains offset.
+    int nodeAt(int offset) const {
+        return std::upper_bound(runOffsets.constBegin(), runOffsets.constEnd(), offset) - runOffsets.constBegin() - 1;
+    }
+    
+    QHtmlDocumentPrivate *dp;
+    const QRegularExpression &regExp;
+    Counters &counters;
+    TidyBuffer buffer;
+    QString run;
+    QVector<TidyNode> runNodes;
+    QVector<int> runOffsets;
+    int position;
+    QHash<TidyNode, int> entryOffsets;
+};
+
+template <typename Counters>
+static void matchText(QHtmlDocumentPrivate *dp, TidyNode scope, const QRegularExpression &regExp, Counters &counters,
+                      QList<TextMatchResult> &results) {
+    TextMatcher<Counters> matcher(dp, regExp, counters);
+    matcher.match(scope);
+    results = matcher.results;
+}
+#endif
+
+/*
+ * Chooses how to find the candidate elements below scope for the attribute matches. The indexes 
+ * are looked up with the mutex of the document locked, and the candidates are copied to the plan, 
+ * so that the indexes can be changed by another thread while the plan is executed.
+ */
+static void planQuery(QHtmlDocumentPrivate *dp, TidyNode scope, const QHtmlAttributeMatches &matches,
+                      QHtmlParser::MatchType matchType, QueryPlan &plan) {
+    if ((matches.isEmpty()) || ((matchType != QHtmlParser::MatchAll) && (matches.size() > 1))) {
+        return;
+    }
+    
+    dp->mutex.lock();
+    const int generation = dp->generation;
+    const bool useValueIndex = !dp->valueIndexedAttributes.isEmpty();
+    const bool useAttributeIndex = (dp->attributeIndexEnabled) && (matchType == QHtmlParser::MatchAll);
+    dp->mutex.unlock();
+    QVector<int> positions;
+    
+    if (useValueIndex) {
+        dp->ensureValueIndexes();
+        QMutexLocker locker(&dp->mutex);
+        QVector<int> candidates;
+        
+        if (dp->valueIndexesBuilt) {
+            foreach (const QHtmlAttributeMatch &match, matches) {
+                if ((valueCandidates(dp, scope, match, candidates))
+                    && ((plan.strategy == QHtmlParser::FullScan) || (candidates.size() < positions.size()))) {
+                    plan.strategy = QHtmlParser::ValueIndex;
+                    positions = candidates;
+                }
+            }
+        }
+    }
+    
+    if ((plan.strategy == QHtmlParser::FullScan) && (useAttributeIndex)) {
+        dp->ensureAttributeIndex();
+        QMutexLocker locker(&dp->mutex);
+        QVector<int>::const_iterator bestFirst;
+        QVector<int>::const_iterator bestLast;
+        bool found = dp->attributeIndexBuilt;
+        
+        for (int i = 0; (found) && (i < matches.size()); ++i) {
+            QVector<int>::const_iterator first;
+            QVector<int>::const_iterator last;
+            found = indexedRange(dp, scope, matches.at(i).name().toUtf8(), first, last);
+            
+            if ((found) && ((i == 0) || (last - first < bestLast - bestFirst))) {
+                bestFirst = first;
+                bestLast = last;
+            }
+        }
+        
+        if (found) {
+            plan.strategy = QHtmlParser::AttributeIndex;
+            
+            for (; bestFirst != bestLast; ++bestFirst) {
+                positions << *bestFirst;
+            }
+        }
+    }
+    
+    if (plan.strategy == QHtmlParser::FullScan) {
+        return;
+    }
+    
+    // The positions are only valid for the parse they were found in, so the content must not have been set since.
+    QMutexLocker locker(&dp->mutex);
+    const int index = dp->nodeIndices.value(scope, -1);
+    
+    if ((dp->generation != generation) || (index < 0)) {
+        plan.strategy = QHtmlParser::FullScan;
+        return;
+    }
+    
+    const int end = dp->subtreeEnds.at(index);
+    plan.nodes.reserve(positions.size());
+    
+    foreach (int position, positions) {
+        plan.nodes << dp->orderedNodes.at(position);
+    }
+    
+    if (end > index) {
+        plan.firstNode = dp->orderedNodes.at(index + 1);
+        plan.lastNode = dp->orderedNodes.at(end);
+    }
+}
+
+// Returns the number of levels node is below scope, which must be one of its ancestors.
+static int nodeDepth(TidyNode node, TidyNode scope) {
+    int depth = 0;
+    
+    for (; (node) && (node != scope); node = tidyGetParent(node)) {
+        ++depth;
+    }
+    
+    return depth;
+}
+
+// Returns the nearest next or previous sibling of node with the tag name and matching attributes, or 0.
+template <typename Counters>
+static TidyNode siblingStartNode(TidyNode node, bool next, const QByteArray &name, const QHtmlAttributeMatches &matches,
+                                 QHtmlParser::MatchType matchType, Counters &counters) {
+    for (node = (next ? nextSiblingStartNode(node) : previousSiblingStartNode(node)); node;
+         node = (next ? nextSiblingStartNode(node) : previousSiblingStartNode(node))) {
+        if (matchNode(node, name, &matches, matchType, counters)) {
+            counters.match();
+            return node;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Counts the elements below scope with the tag name and matching attributes, up to limit if it is 
+ * not negative. Only the candidates of plan are examined, unless its strategy is FullScan.
+ */
+template <typename Counters>
+static int countMatchingNodes(TidyNode scope, const QByteArray &name, const QHtmlAttributeMatches *matches,
+                              QHtmlParser::MatchType matchType, const QueryPlan &plan, int limit, Counters &counters) {
+    int count = 0;
+    
+    if (plan.strategy != QHtmlParser::FullScan) {
+        foreach (TidyNode node, plan.nodes) {
+            if (matchNode(node, name, matches, matchType, counters)) {
+                counters.match();
+                
+                if (++count == limit) {
+                    break;
+                }
+            }
+        }
+        
+        return count;
+    }
+    
+    for (TidyNode node = nextStartNode(scope, scope); node; node = nextStartNode(node, scope)) {
+        if (matchNode(node, name, matches, matchType, counters)) {
+            counters.match();
+            
+            if (++count == limit) {
+                break;
+            }
+        }
+    }
+    
+    return count;
+}
+
+class NullQueryCounters
+{
+
+public:
+    void visit() {}
+    void evaluate(int, bool) {}
+    void compile(int) {}
+    void match() {}
+    void matches(int) {}
+};
+
+class QueryCounters
+{
+
+public:
+    void visit() { ++stats.nodesVisited; }
+    void evaluate(int, bool) { ++stats.predicatesEvaluated; }
+    void compile(int) {}
+    void match() { ++stats.matches; }
+    void matches(int count) { stats.matches += count; }
+    
+    QHtmlQueryStats stats;
+};
+
+class ProfileCounters
+{
+
+public:
+    explicit ProfileCounters(QHtmlQueryProfile &p) :
+        profile(p)
+    {
+    }
+    
+    void visit() {
+        ++profile.stats.nodesVisited;
+    }
+    
+    void evaluate(int index, bool matched) {
+        ++profile.stats.predicatesEvaluated;
+        QHtmlAttributeMatchProfile &match = profile.matches[index];
+        ++match.evaluations;
+        
+        if (matched) {
+            ++match.successes;
+        }
+    }
+    
+    void compile(int index) {
+        ++profile.matches[index].regExpCompiles;
+    }
+    
+    void match() {
+        ++profile.stats.matches;
+    }
+    
+    void matches(int count) {
+        profile.stats.matches += count;
+    }
+    
+    QHtmlQueryProfile &profile;
+};
+
+#if defined(QHTMLPARSER_STATS) || defined(QHTMLPARSER_USDT)
+#define QHTMLPARSER_COUNTERS
+#endif
+
+class QueryScope
+{
+
+public:
+    explicit QueryScope(const QHtmlElementPrivate *d, const char *f) :
+        document(d->document),
+        function(f),
+        sinks(instrumentationSinks() & (TracerSink | MonitorSink | MetricsSink)),
+        traceStart(-1)
+    {
+        start();
+    }
+    
+    QueryScope(TidyDoc doc, const char *f) :
+        document(doc),
+        function(f),
+        sinks(instrumentationSinks() & (TracerSink | MonitorSink | MetricsSink)),
+        traceStart(-1)
+    {
+        start();
+    }
+    
+    ~QueryScope() {
+#ifdef QHTMLPARSER_STATS
+        documentPrivate(document)->addQuery(counters.stats, timer.nsecsElapsed());
+#endif
+        QHTMLPARSER_PROBE4(query__done, documentPrivate(document)->id, function, counters.stats.nodesVisited,
+                           counters.stats.matches);
+        
+        if (!sinks) {
+            return;
+        }
+        
+        if (traceStart >= 0) {
+            tracer()->addEvent(function, "query", traceStart, documentPrivate(document)->id, QByteArray());
+        }
+        
+        if (sinks & MonitorSink) {
+            QHtmlQueryStats query;
+#ifdef QHTMLPARSER_COUNTERS
+            query = counters.stats;
+#endif
+            query.elapsed = timer.nsecsElapsed();
+            documentPrivate(document)->checkQuery(function, query);
+        }
+        
+        if (sinks & MetricsSink) {
+            metrics()->queried(function, timer.nsecsElapsed());
+        }
+    }
+    
+#ifdef QHTMLPARSER_COUNTERS
+    QueryCounters counters;
+#else
+    NullQueryCounters counters;
+#endif
+    
+private:
+    void start() {
+        QHTMLPARSER_PROBE2(query__start, documentPrivate(document)->id, function);
+        
+        if (sinks & TracerSink) {
+            traceStart = tracer()->timestamp();
+        }
+#ifdef QHTMLPARSER_STATS
+        timer.start();
+#else
+        if (sinks & (MonitorSink | MetricsSink)) {
+            timer.start();
+        }
+#endif
+    }
+    
+    TidyDoc document;
+    const char *function;
+    int sinks;
+    qint64 traceStart;
+    QElapsedTimer timer;
+};
+
+class RenderScope
+{
+
+public:
+    explicit RenderScope(TidyDoc doc, const char *f) :
+        bytes(0),
+        document(doc),
+        function(f),
+        traceStart((instrumentationSinks() & TracerSink) ? tracer()->timestamp() : -1)
+    {
+        QHTMLPARSER_PROBE2(render__start, documentPrivate(document)->id, function);
+#ifdef QHTMLPARSER_STATS
+        timer.start();
+#endif
+    }
+    
+    ~RenderScope() {
+#ifdef QHTMLPARSER_STATS
+        documentPrivate(document)->addRender(timer.nsecsElapsed());
+#endif
+        if (renderBuffers.hasLocalData()) {
+            TidyBuffer &output = renderBuffers.localData()->buffer;
+            
+            if (output.allocated > maxRetainedOutput) {
+                tidyBufFree(&output);
+            }
+        }
+        
+        QHTMLPARSER_PROBE3(render__done, documentPrivate(document)->id, function, bytes);
+        
+        if (traceStart >= 0) {
+            tracer()->addEvent(function, "render", traceStart, documentPrivate(document)->id,
+                               "\"bytes\":" + QByteArray::number(bytes));
+        }
+    }
+    
+    // Returns the calling thread's output buffer, emptied without releasing or zeroing its allocation.
+    TidyBuffer& buffer() {
+        if (!renderBuffers.hasLocalData()) {
+            renderBuffers.setLocalData(new RenderBuffer);
+        }
+        
+        TidyBuffer &output = renderBuffers.localData()->buffer;
+        output.size = 0;
+        output.next = 0;
+        return output;
+    }
+    
+    // Returns the lock that must be held while tidy prints the document into the buffer.
+    QMutex* printMutex() {
+        return &documentPrivate(document)->printMutex;
+    }
+    
+    uint bytes;
+    
+private:
+    TidyDoc document;
+    const char *function;
+    qint64 traceStart;
+#ifdef QHTMLPARSER_STATS
+    QElapsedTimer timer;
+#endif
+};
+
+QHtmlElement::QHtmlElement() :
+    d(new QHtmlElementPrivate)
+{
+}
+
+QHtmlElement::QHtmlElement(const QHtmlElement &other) :
+    d(new QHtmlElementPrivate)
+{
+    d->document = other.d->document;
+    d->node = other.d->node;
+}
+
+QHtmlElement::~QHtmlElement() {
+    delete d;
+}
+
+QHtmlAttributes QHtmlElement::attributes() const {
+    QHtmlAttributes attrs;
+    
+    if (!d->node) {
+        return attrs;
+    }
+    
+    TidyAttr attr;
+    
+    for (attr = tidyAttrFirst(d->node); attr; attr = tidyAttrNext(attr)) {
+        attrs << QHtmlAttribute(tidyAttrName(attr), tidyAttrValue(attr));
+    }
+    
+    return attrs;
+}
+
+QString QHtmlElement::attribute(const QString &name) const {
+    if (!d->node) {
+        return QString();
+    }
+    
+    const ctmbstr value = nodeAttribute(d->node, name);
+    
+    if (value) {
+        return value;
+    }
+    
+    return QString();
+}
+
+QHtmlElement QHtmlElement::parentElement() const {
+    QHtmlElement element;
+
+    if (!d->node) {
+        return element;
+    }
+
+    TidyNode node = tidyGetParent(d->node);
+
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+
+    return element;
+}
+
+QHtmlElement QHtmlElement::nextSibling() const {
+    QHtmlElement element;
+
+    if (!d->node) {
+        return element;
+    }
+
+    TidyNode node = nextSiblingStartNode(d->node);
+
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+
+    return element;
+}
+
+QHtmlElement QHtmlElement::previousSibling() const {
+    QHtmlElement element;
+
+    if (!d->node) {
+        return element;
+    }
+
+    TidyNode node = previousSiblingStartNode(d->node);
+
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+
+    return element;
+}
+
+QHtmlElementList QHtmlElement::childElements() const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    foreach (TidyNode node, childStartNodes(d->node)) {
+        QHtmlElement element;
+        element.d->document = d->document;
+        element.d->node = node;
+        elements << element;
+    }
+    
+    return elements;
+}
+
+QHtmlElement QHtmlElement::firstChildElement() const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    TidyNode node = childStartNode(d->node);
+    
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::lastChildElement() const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    const QList<TidyNode> nodes = childStartNodes(d->node);
+    
+    if (!nodes.isEmpty()) {
+        element.d->document = d->document;
+        element.d->node = nodes.last();
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::nthChildElement(int n) const {
+    if (n == 0) {
+        return firstChildElement();
+    }
+    
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    const QList<TidyNode> nodes = childStartNodes(d->node);
+    
+    if (n < 0) {
+        if (nodes.size() + n >= 0) {
+            element.d->document = d->document;
+            element.d->node = nodes.at(nodes.size() + n);
+        }
+    }
+    else if (n < nodes.size() - 1) {
+        element.d->document = d->document;
+        element.d->node = nodes.at(n);
+    }
+
+    return element;
+}
+
+QHtmlElement QHtmlElement::elementById(const QString &id) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "elementById", QList<QByteArray>() << QUrl::toPercentEncoding(id));
+    }
+    
+    QueryScope scope(d, "elementById");
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    QByteArray key;
+    
+    if (dp->isQueryCacheEnabled()) {
+        key = queryKey(d->node, "elementById", id);
+        QHtmlElementList elements;
+        
+        if (dp->cachedQuery(key, elements)) {
+            if (elements.isEmpty()) {
+                return element;
+            }
+            
+            scope.counters.match();
+            return elements.first();
+        }
+    }
+    
+    
+    foreach (TidyNode node, allStartNodes(d->node)) {
+        scope.counters.visit();
+        
+        ctmbstr value = nodeAttribute(node, "id");
+        const bool matched = (value) && (value == id);
+        scope.counters.evaluate(0, matched);
+
+        if (matched) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = node;
+            break;
+        }
+    }
+    
+    if (!key.isEmpty()) {
+        dp->cacheQuery(key, element.isNull() ? QHtmlElementList() : QHtmlElementList() << element);
+    }
+    
+    return element;
+}
+
+QHtmlElementList QHtmlElement::elementsByTagName(const QString &name) const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "elementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "elementsByTagName");
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    QByteArray key;
+    
+    if (dp->isQueryCacheEnabled()) {
+        key = queryKey(d->node, "elementsByTagName", name);
+        
+        if (dp->cachedQuery(key, elements)) {
+            scope.counters.matches(elements.size());
+            return elements;
+        }
+    }
+    
+    
+    foreach (TidyNode node, allStartNodes(d->node)) {
+        scope.counters.visit();
+        
+        if (tidyNodeGetName(node) == name) {
+            scope.counters.match();
+            QHtmlElement element;
+            element.d->document = d->document;
+            element.d->node = node;
+            elements << element;
+        }
+    }
+
+    if (!key.isEmpty()) {
+        dp->cacheQuery(key, elements);
+    }
+    
+    return elements;
+}
+
+QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return elementsByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                 QHtmlParser::MatchType matchType) const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "elementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "elementsByTagName");
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    QByteArray key;
+    
+    if (dp->isQueryCacheEnabled()) {
+        key = queryKey(d->node, "elementsByTagName", name, matches, matchType);
+        
+        if (dp->cachedQuery(key, elements)) {
+            scope.counters.matches(elements.size());
+            return elements;
+        }
+    }
+    
+    QueryPlan plan;
+    planQuery(dp, d->node, matches, matchType, plan);
+    
+    foreach (TidyNode node, (plan.strategy != QHtmlParser::FullScan ? plan.nodes : allStartNodes(d->node))) {
+        scope.counters.visit();
+        
+        if ((tidyNodeGetName(node) == name) && (matchAttributes(node, matches, matchType, scope.counters))) {
+            scope.counters.match();
+            QHtmlElement element;
+            element.d->document = d->document;
+            element.d->node = node;
+            elements << element;
+        }
+    }
+    
+    if (!key.isEmpty()) {
+        dp->cacheQuery(key, elements);
+    }
+    
+    return elements;
+}
+
+QHtmlElementList QHtmlElement::elementsWithAttribute(const QString &name) const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "elementsWithAttribute", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "elementsWithAttribute");
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    const QByteArray attributeName = name.toUtf8();
+    QList<TidyNode> nodes;
+    
+    if (indexedNodes(dp, d->node, attributeName, nodes)) {
+        elements.reserve(nodes.size());
+        
+        foreach (TidyNode node, nodes) {
+            scope.counters.visit();
+            scope.counters.match();
+            QHtmlElement element;
+            element.d->document = d->document;
+            element.d->node = node;
+            elements << element;
+        }
+        
+        return elements;
+    }
+    
+    for (TidyNode node = nextStartNode(d->node, d->node); node; node = nextStartNode(node, d->node)) {
+        scope.counters.visit();
+        
+        for (TidyAttr attr = tidyAttrFirst(node); attr; attr = tidyAttrNext(attr)) {
+            if (qstrcmp(tidyAttrName(attr), attributeName.constData()) == 0) {
+                scope.counters.match();
+                QHtmlElement element;
+                element.d->document = d->document;
+                element.d->node = node;
+                elements << element;
+                break;
+            }
+        }
+    }
+    
+    return elements;
+}
+
+QHtmlElement QHtmlElement::firstElementByTagName(const QString &name) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "firstElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "firstElementByTagName");
+    
+    foreach (TidyNode node, allStartNodes(d->node)) {
+        scope.counters.visit();
+        
+        if (tidyNodeGetName(node) == name) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = node;
+            break;
+        }
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::firstElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return firstElementByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::firstElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                 QHtmlParser::MatchType matchType) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "firstElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "firstElementByTagName");
+    QueryPlan plan;
+    planQuery(documentPrivate(d->document), d->node, matches, matchType, plan);
+    
+    foreach (TidyNode node, (plan.strategy != QHtmlParser::FullScan ? plan.nodes : allStartNodes(d->node))) {
+        scope.counters.visit();
+        
+        if ((tidyNodeGetName(node) == name) && (matchAttributes(node, matches, matchType, scope.counters))) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = node;
+            break;
+        }
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::lastElementByTagName(const QString &name) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "lastElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "lastElementByTagName");
+    const QList<TidyNode> nodes = allStartNodes(d->node);
+
+    for (int i = nodes.size() - 1; i >= 0; --i) {
+        scope.counters.visit();
+        
+        if (tidyNodeGetName(nodes.at(i)) == name) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = nodes.at(i);
+            break;
+        }
+    }
+
+    return element;
+}
+
+QHtmlElement QHtmlElement::lastElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return lastElementByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::lastElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                QHtmlParser::MatchType matchType) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "lastElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "lastElementByTagName");
+    QueryPlan plan;
+    planQuery(documentPrivate(d->document), d->node, matches, matchType, plan);
+    const QList<TidyNode> nodes = (plan.strategy != QHtmlParser::FullScan ? plan.nodes : allStartNodes(d->node));
+
+    for (int i = nodes.size() - 1; i >= 0; --i) {
+        scope.counters.visit();
+        
+        if ((tidyNodeGetName(nodes.at(i)) == name) && (matchAttributes(nodes.at(i), matches, matchType, scope.counters))) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = nodes.at(i);
+            break;
+        }
+    }
+
+    return element;
+}
+
+QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name) const {
+    if (n == 0) {
+        return firstElementByTagName(name);
+    }
+    
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "nthElementByTagName", QList<QByteArray>() << QByteArray::number(n)
+                    << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "nthElementByTagName");
+    const QList<TidyNode> nodes = allStartNodes(d->node);
+
+    if (nodes.isEmpty()) {
+        return element;
+    }
+
+    const int start = (n < 0 ? nodes.size() - 1 : 0);
+    const int end = (n < 0 ? 0 : nodes.size() - 1);
+    int inc = (n < 0 ? -1 : 1);
+    int hits = 0;
+
+    for (int i = start; i != end; i += inc) {
+        scope.counters.visit();
+        
+        if (tidyNodeGetName(nodes.at(i)) == name) {
+            scope.counters.match();
+            
+            if (hits == n) {
+                element.d->document = d->document;
+                element.d->node = nodes.at(i);
+                break;
+            }
+
+            hits += inc;
+        }
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name, const QHtmlAttributeMatch &match) const {
+    return nthElementByTagName(n, name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name, const QHtmlAttributeMatches &matches,
+                                               QHtmlParser::MatchType matchType) const {
+    if (n == 0) {
+        return firstElementByTagName(name, matches, matchType);
+    }
+    
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "nthElementByTagName", QList<QByteArray>() << QByteArray::number(n)
+                    << QUrl::toPercentEncoding(name) << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "nthElementByTagName");
+    QueryPlan plan;
+    planQuery(documentPrivate(d->document), d->node, matches, matchType, plan);
+    const QList<TidyNode> nodes = (plan.strategy != QHtmlParser::FullScan ? plan.nodes : allStartNodes(d->node));
+
+    if (nodes.isEmpty()) {
+        return element;
+    }
+    
+    const int start = (n < 0 ? nodes.size() - 1 : 0);
+    int end = (n < 0 ? 0 : nodes.size() - 1);
+    int inc = (n < 0 ? -1 : 1);
+    int hits = 0;
+    
+    // The scan stops before the element at its end, so the last candidate is only skipped if it is that element.
+    if ((plan.strategy != QHtmlParser::FullScan) && (nodes.at(end) != (n < 0 ? plan.firstNode : plan.lastNode))) {
+        end += inc;
+    }
+
+    for (int i = start; i != end; i += inc) {
+        scope.counters.visit();
+        
+        if ((tidyNodeGetName(nodes.at(i)) == name) && (matchAttributes(nodes.at(i), matches, matchType, scope.counters))) {
+            scope.counters.match();
+            
+            if (hits == n) {
+                element.d->document = d->document;
+                element.d->node = nodes.at(i);
+                break;
+            }
+
+            hits += inc;
+        }
+    }
+    
+    return element;
+}
+
+int QHtmlElement::countElementsByTagName(const QString &name) const {
+    if (!d->node) {
+        return 0;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "countElementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "countElementsByTagName");
+    return countMatchingNodes(d->node, name.toUtf8(), 0, QHtmlParser::MatchAll, QueryPlan(), -1, scope.counters);
+}
+
+int QHtmlElement::countElementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return countElementsByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+int QHtmlElement::countElementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                         QHtmlParser::MatchType matchType) const {
+    if (!d->node) {
+        return 0;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "countElementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "countElementsByTagName");
+    QueryPlan plan;
+    planQuery(documentPrivate(d->document), d->node, matches, matchType, plan);
+    return countMatchingNodes(d->node, name.toUtf8(), &matches, matchType, plan, -1, scope.counters);
+}
+
+bool QHtmlElement::hasElementByTagName(const QString &name) const {
+    if (!d->node) {
+        return false;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "hasElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name));
+    }
+    
+    QueryScope scope(d, "hasElementByTagName");
+    return countMatchingNodes(d->node, name.toUtf8(), 0, QHtmlParser::MatchAll, QueryPlan(), 1, scope.counters) > 0;
+}
+
+bool QHtmlElement::hasElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return hasElementByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+bool QHtmlElement::hasElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                       QHtmlParser::MatchType matchType) const {
+    if (!d->node) {
+        return false;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "hasElementByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "hasElementByTagName");
+    QueryPlan plan;
+    planQuery(documentPrivate(d->document), d->node, matches, matchType, plan);
+    return countMatchingNodes(d->node, name.toUtf8(), &matches, matchType, plan, 1, scope.counters) > 0;
+}
+
+QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, int maxDepth) const {
+    return elementsByTagName(name, QHtmlAttributeMatches(), QHtmlParser::MatchAll, maxDepth);
+}
+
+QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                 QHtmlParser::MatchType matchType, int maxDepth) const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "elementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType) << QByteArray::number(maxDepth));
+    }
+    
+    QueryScope scope(d, "elementsByTagName");
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    QByteArray key;
+    
+    if (dp->isQueryCacheEnabled()) {
+        key = queryKey(d->node, "elementsByTagName", name, matches, matchType, qMax(0, maxDepth));
+        
+        if (dp->cachedQuery(key, elements)) {
+            scope.counters.matches(elements.size());
+            return elements;
+        }
+    }
+    
+    const QByteArray tagName = name.toUtf8();
+    QueryPlan plan;
+    planQuery(dp, d->node, matches, matchType, plan);
+    
+    if (plan.strategy != QHtmlParser::FullScan) {
+        foreach (TidyNode node, plan.nodes) {
+            if ((nodeDepth(node, d->node) <= maxDepth) && (matchNode(node, tagName, &matches, matchType, scope.counters))) {
+                scope.counters.match();
+                QHtmlElement element;
+                element.d->document = d->document;
+                element.d->node = node;
+                elements << element;
+            }
+        }
+    }
+    else {
+        int depth = 0;
+        
+        for (TidyNode node = nextNode(d->node, d->node, depth, maxDepth); node;
+             node = nextNode(node, d->node, depth, maxDepth)) {
+            if ((isStartNode(node)) && (matchNode(node, tagName, &matches, matchType, scope.counters))) {
+                scope.counters.match();
+                QHtmlElement element;
+                element.d->document = d->document;
+                element.d->node = node;
+                elements << element;
+            }
+        }
+    }
+    
+    if (!key.isEmpty()) {
+        dp->cacheQuery(key, elements);
+    }
+    
+    return elements;
+}
+
+QHtmlElementList QHtmlElement::childElementsByTagName(const QString &name) const {
+    return childElementsByTagName(name, QHtmlAttributeMatches());
+}
+
+QHtmlElementList QHtmlElement::childElementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return childElementsByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElementList QHtmlElement::childElementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                      QHtmlParser::MatchType matchType) const {
+    QHtmlElementList elements;
+    
+    if (!d->node) {
+        return elements;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "childElementsByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "childElementsByTagName");
+    const QByteArray tagName = name.toUtf8();
+    
+    for (TidyNode node = childStartNode(d->node); node; node = nextSiblingStartNode(node)) {
+        if (matchNode(node, tagName, &matches, matchType, scope.counters)) {
+            scope.counters.match();
+            QHtmlElement element;
+            element.d->document = d->document;
+            element.d->node = node;
+            elements << element;
+        }
+    }
+    
+    return elements;
+}
+
+QHtmlElement QHtmlElement::nextSiblingByTagName(const QString &name) const {
+    return nextSiblingByTagName(name, QHtmlAttributeMatches());
+}
+
+QHtmlElement QHtmlElement::nextSiblingByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return nextSiblingByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::nextSiblingByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                QHtmlParser::MatchType matchType) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "nextSiblingByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "nextSiblingByTagName");
+    const TidyNode node = siblingStartNode(d->node, true, name.toUtf8(), matches, matchType, scope.counters);
+    
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::previousSiblingByTagName(const QString &name) const {
+    return previousSiblingByTagName(name, QHtmlAttributeMatches());
+}
+
+QHtmlElement QHtmlElement::previousSiblingByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
+    return previousSiblingByTagName(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::previousSiblingByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                                    QHtmlParser::MatchType matchType) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "previousSiblingByTagName", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "previousSiblingByTagName");
+    const TidyNode node = siblingStartNode(d->node, false, name.toUtf8(), matches, matchType, scope.counters);
+    
+    if (node) {
+        element.d->document = d->document;
+        element.d->node = node;
+    }
+    
+    return element;
+}
+
+QHtmlElement QHtmlElement::closest(const QString &name) const {
+    return closest(name, QHtmlAttributeMatches());
+}
+
+QHtmlElement QHtmlElement::closest(const QString &name, const QHtmlAttributeMatch &match) const {
+    return closest(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlElement QHtmlElement::closest(const QString &name, const QHtmlAttributeMatches &matches,
+                                   QHtmlParser::MatchType matchType) const {
+    QHtmlElement element;
+    
+    if (!d->node) {
+        return element;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "closest", QList<QByteArray>() << QUrl::toPercentEncoding(name)
+                    << encodeMatches(matches) << QByteArray::number(matchType));
+    }
+    
+    QueryScope scope(d, "closest");
+    const QByteArray tagName = name.toUtf8();
+    
+    for (TidyNode node = d->node; node; node = tidyGetParent(node)) {
+        if ((isStartNode(node)) && (matchNode(node, tagName, &matches, matchType, scope.counters))) {
+            scope.counters.match();
+            element.d->document = d->document;
+            element.d->node = node;
+            break;
+        }
+    }
+    
+    return element;
+}
+
+bool QHtmlElement::nextDescendant(QHtmlElement &element, bool descend) const {
+    if (!d->node) {
+        return false;
+    }
+    
+    const TidyNode node = (element.d->node ? nextStartNode(element.d->node, d->node, descend)
+                                           : nextStartNode(d->node, d->node));
+    element.d->document = (node ? d->document : 0);
+    element.d->node = node;
+    return node != 0;
+}
+
+QString QHtmlElement::tagName() const {
+    if (d->node) {
+        return tidyNodeGetName(d->node);
+    }
+    
+    return QString();
+}
+
+QString QHtmlElement::text(bool includeChildElements) const {    
+    if ((!d->document) || (!d->node)) {
+        return QString();
+    }
+    
+    RenderScope scope(d->document, "text");
+    TidyBuffer &buffer = scope.buffer();
+    QMutexLocker locker(scope.printMutex());
+    appendText(d->document, d->node, includeChildElements, buffer);
+    locker.unlock();
+    scope.bytes = buffer.size;
+    return bufferText(buffer);
+}
+
+void QHtmlElement::text(QString &out, bool includeChildElements) const {
+    if ((!d->document) || (!d->node)) {
+        return;
+    }
+    
+    RenderScope scope(d->document, "text");
+    TidyBuffer &buffer = scope.buffer();
+    QMutexLocker locker(scope.printMutex());
+    appendText(d->document, d->node, includeChildElements, buffer);
+    locker.unlock();
+    scope.bytes = buffer.size;
+    
+    if (buffer.size > 0) {
+        out += bufferText(buffer);
+    }
+}
+
+QString QHtmlElement::toString() const {    
+    if ((!d->document) || (!d->node)) {
+        return QString();
+    }
+    
+    RenderScope scope(d->document, "toString");
+    TidyBuffer &buffer = scope.buffer();
+    QMutexLocker locker(scope.printMutex());
+    const bool printed = tidyNodeGetText(d->document, d->node, &buffer);
+    locker.unlock();
+    
+    if (printed) {
+        scope.bytes = buffer.size;
+        return QString::fromUtf8((char *)buffer.bp, buffer.size).trimmed();
+    }
+    
+    return QString();
+}
+
+quint64 QHtmlElement::contentHash() const {
+    if ((!d->document) || (!d->node)) {
+        return 0;
+    }
+    
+    return documentPrivate(d->document)->contentHash(d->node);
+}
+
+#if QT_VERSION >= 0x050000
+QHtmlTextMatches QHtmlElement::findText(const QRegularExpression &regExp) const {
+    QHtmlTextMatches matches;
+    
+    if ((!d->document) || (!d->node) || (!regExp.isValid())) {
+        return matches;
+    }
+    
+    if (recorder()->isActive()) {
+        recordQuery(d, "findText", QList<QByteArray>() << QUrl::toPercentEncoding(regExp.pattern())
+                    << QByteArray::number(int(regExp.patternOptions())));
+    }
+    
+    QueryScope scope(d, "findText");
+#if QT_VERSION >= 0x050400
+    // Compiles the pattern, using the JIT where available, before it is applied to the first run.
+    regExp.optimize();
+#endif
+    QList<TextMatchResult> results;
+    matchText(documentPrivate(d->document), d->node, regExp, scope.counters, results);
+    
+    foreach (const TextMatchResult &result, results) {
+        QHtmlTextMatch match;
+        match.element.d->document = d->document;
+        match.element.d->node = result.node;
+        match.offset = result.offset;
+        match.length = result.length;
+        match.capturedTexts = result.capturedTexts;
+        matches << match;
+    }
+    
+    return matches;
+}
+#endif
+
+QHtmlQueryProfile QHtmlElement::explain(const QString &name) const {
+    return explain(name, QHtmlAttributeMatches());
+}
+
+QHtmlQueryProfile QHtmlElement::explain(const QString &name, const QHtmlAttributeMatch &match) const {
+    return explain(name, QHtmlAttributeMatches() << match);
+}
+
+QHtmlQueryProfile QHtmlElement::explain(const QString &name, const QHtmlAttributeMatches &matches,
+                                        QHtmlParser::MatchType matchType) const {
+    QHtmlQueryProfile profile;
+    
+    foreach (const QHtmlAttributeMatch &match, matches) {
+        QHtmlAttributeMatchProfile matchProfile;
+        matchProfile.match = match;
+        profile.matches << matchProfile;
+    }
+    
+    if (!d->node) {
+        return profile;
+    }
+    
+    ProfileCounters counters(profile);
+    QElapsedTimer timer;
+    timer.start();
+    QHtmlDocumentPrivate *dp = documentPrivate(d->document);
+    QueryPlan plan;
+    planQuery(dp, d->node, matches, matchType, plan);
+    profile.strategy = plan.strategy;
+    
+    foreach (TidyNode node, (plan.strategy != QHtmlParser::FullScan ? plan.nodes : allStartNodes(d->node))) {
+        counters.visit();
+        
+        if ((tidyNodeGetName(node) == name) && (matchAttributes(node, matches, matchType, counters))) {
+            counters.match();
+        }
+    }
+    
+    profile.stats.elapsed = timer.nsecsElapsed();
+    return profile;
+}
+
+bool QHtmlElement::isNull() const {
+    return (!d->document) || (!d->node);
+}
+
+QHtmlElement& QHtmlElement::operator=(const QHtmlElement &other) {
+    d->document = other.d->document;
+    d->node = other.d->node;
+    return *this;
+}
+
+bool QHtmlElement::operator==(const QHtmlElement &other) const {
+    return (other.d->document == d->document) && (other.d->node == d->node);
+}
+
+bool QHtmlElement::operator!=(const QHtmlElement &other) const {
+    return (other.d->document != d->document) || (other.d->node != d->node);
+}
+
+class QHtmlElementSetPrivate
+{
+
+public:
+    QHtmlElementSetPrivate() :
+        document(0),
+        generation(0)
+    {
+    }
+    
+    /*
+     * Returns the position of node in document order, or -1 if it does not belong to the parse of the 
+     * set's document that the set was created from. Adopts the document of node if the set has none.
+     */
+    int indexOf(TidyDoc doc, TidyNode node) {
+        if ((!doc) || (!node)) {
+            return -1;
+        }
+        
+        QHtmlDocumentPrivate *dp = documentPrivate(doc);
+        
+        if (!document) {
+            QMutexLocker locker(&dp->mutex);
+            document = dp;
+            generation = dp->generation;
+        }
+        else if (dp != document) {
+            return -1;
+        }
+        
+        dp->ensureOrderIndex();
+        QMutexLocker locker(&dp->mutex);
+        return (dp->generation == generation) ? dp->nodeIndices.value(node, -1) : -1;
+    }
+    
+    // Returns true if the content of the set's document has not been set since the set was created.
+    bool isCurrent() const {
+        if (!document) {
+            return false;
+        }
+        
+        QMutexLocker locker(&document->mutex);
+        return document->generation == generation;
+    }
+    
+    // Returns true if other holds positions of the same parse of the same document.
+    bool sameParse(const QHtmlElementSetPrivate *other) const {
+        return (other->document == document) && (other->generation == generation);
+    }
+    
+    // Adopts the document of other if this set is empty, and returns false if the parses differ.
+    bool adopt(const QHtmlElementSetPrivate *other) {
+        if (indices.isEmpty()) {
+            document = other->document;
+            generation = other->generation;
+            return true;
+        }
+        
+        return (other->indices.isEmpty()) || (sameParse(other));
+    }
+    
+    // Returns the element at each position in indices, or no elements if the set is no longer current.
+    QHtmlElementList elements(const QVector<int> &positions) const {
+        QHtmlElementList result;
+        
+        if ((!document) || (positions.isEmpty())) {
+            return result;
+        }
+        
+        QMutexLocker locker(&document->mutex);
+        
+        if (document->generation != generation) {
+            return result;
+        }
+        
+        result.reserve(positions.size());
+        
+        foreach (int index, positions) {
+            QHtmlElement element;
+            element.d->document = document->document;
+            element.d->node = document->orderedNodes.at(index);
+            result << element;
+        }
+        
+        return result;
+    }
+    
+    QHtmlDocumentPrivate *document;
+    int generation;
+    QVector<int> indices;
+};
+
+QHtmlElementSet::QHtmlElementSet() :
+    d(new QHtmlElementSetPrivate)
+{
+}
+
+QHtmlElementSet::QHtmlElementSet(const QHtmlElementList &elements) :
+    d(new QHtmlElementSetPrivate)
+{
+    d->indices.reserve(elements.size());
+    
+    foreach (const QHtmlElement &element, elements) {
+        const int index = d->indexOf(element.d->document, element.d->node);
+        
+        if (index >= 0) {
+            d->indices << index;
+        }
+    }
+    
+    std::sort(d->indices.begin(), d->indices.end());
+    d->indices.resize(std::unique(d->indices.begin(), d->indices.end()) - d->indices.begin());
+}
+
+QHtmlElementSet::QHtmlElementSet(const QHtmlElementSet &other) :
+    d(new QHtmlElementSetPrivate)
+{
+    d->document = other.d->document;
+    d->generation = other.d->generation;
+    d->indices = other.d->indices;
+}
+
+QHtmlElementSet::~QHtmlElementSet() {
+    delete d;
+}
+
+int QHtmlElementSet::size() const {
+    return ((!d->indices.isEmpty()) && (d->isCurrent())) ? d->indices.size() : 0;
+}
+
+bool QHtmlElementSet::isEmpty() const {
+    return size() == 0;
+}
+
+bool QHtmlElementSet::contains(const QHtmlElement &element) const {
+    if (d->indices.isEmpty()) {
+        return false;
+    }
+    
+    const int index = d->indexOf(element.d->document, element.d->node);
+    return (index >= 0) && (std::binary_search(d->indices.constBegin(), d->indices.constEnd(), index));
+}
+
+void QHtmlElementSet::insert(const QHtmlElement &element) {
+    if ((d->indices.isEmpty()) || (!d->isCurrent())) {
+        d->document = 0;
+        d->indices.clear();
+    }
+    
+    const int index = d->indexOf(element.d->document, element.d->node);
+    
+    if (index >= 0) {
+        QVector<int>::iterator position = std::lower_bound(d->indices.begin(), d->indices.end(), index);
+        
+        if ((position == d->indices.end()) || (*position != index)) {
+            d->indices.insert(position - d->indices.begin(), index);
+        }
+    }
+}
+
+QHtmlElement QHtmlElementSet::at(int i) const {
+    if ((i < 0) || (i >= d->indices.size())) {
+        return QHtmlElement();
+    }
+    
+    const QHtmlElementList elements = d->elements(QVector<int>() << d->indices.at(i));
+    return elements.isEmpty() ? QHtmlElement() : elements.first();
+}
+
+QHtmlElementList QHtmlElementSet::toList() const {
+    return d->elements(d->indices);
+}
+
+QHtmlElementSet QHtmlElementSet::within(const QHtmlElement &ancestor) const {
+    QHtmlElementSet result;
+    
+    if (d->indices.isEmpty()) {
+        return result;
+    }
+    
+    const int index = d->indexOf(ancestor.d->document, ancestor.d->node);
+    
+    if (index < 0) {
+        return result;
+    }
+    
+    QMutexLocker locker(&d->document->mutex);
+    
+    if (d->document->generation != d->generation) {
+        return result;
+    }
+    
+    const int end = d->document->subtreeEnds.at(index);
+    locker.unlock();
+    QVector<int>::const_iterator first = std::upper_bound(d->indices.constBegin(), d->indices.constEnd(), index);
+    QVector<int>::const_iterator last = std::upper_bound(first, d->indices.constEnd(), end);
+    result.d->document = d->document;
+    result.d->generation = d->generation;
+    
+    for (; first != last; ++first) {
+        result.d->indices << *first;
+    }
+    
+    return result;
+}
+
+QHtmlElementSet& QHtmlElementSet::unite(const QHtmlElementSet &other) {
+    if (!d->isCurrent()) {
+        d->document = 0;
+        d->indices.clear();
+    }
+    
+    if ((other.d->indices.isEmpty()) || (!other.d->isCurrent()) || (!d->adopt(other.d))) {
+        return *this;
+    }
+    
+    QVector<int> indices(d->indices.size() + other.d->indices.size());
+    const QVector<int>::iterator end = std::set_union(d->indices.constBegin(), d->indices.constEnd(),
+                                                      other.d->indices.constBegin(), other.d->indices.constEnd(), indices.begin());
+    indices.resize(end - indices.begin());
+    d->indices = indices;
+    return *this;
+}
+
+QHtmlElementSet& QHtmlElementSet::intersect(const QHtmlElementSet &other) {
+    if ((d->indices.isEmpty()) || (other.d->indices.isEmpty()) || (!d->sameParse(other.d)) || (!d->isCurrent())) {
+        d->indices.clear();
+        return *this;
+    }
+    
+    QVector<int> indices(qMin(d->indices.size(), other.d->indices.size()));
+    const QVector<int>::iterator end = std::set_intersection(d->indices.constBegin(), d->indices.constEnd(),
+                                                             other.d->indices.constBegin(), other.d->indices.constEnd(), indices.begin());
+    indices.resize(end - indices.begin());
+    d->indices = indices;
+    return *this;
+}
+
+QHtmlElementSet& QHtmlElementSet::subtract(const QHtmlElementSet &other) {
+    if (!d->isCurrent()) {
+        d->indices.clear();
+        return *this;
+    }
+    
+    if ((d->indices.isEmpty()) || (other.d->indices.isEmpty()) || (!d->sameParse(other.d))) {
+        return *this;
+    }
+    
+    QVector<int> indices(d->indices.size());
+    const QVector<int>::iterator end = std::set_difference(d->indices.constBegin(), d->indices.constEnd(),
+                                                           other.d->indices.constBegin(), other.d->indices.constEnd(), indices.begin());
+    indices.resize(end - indices.begin());
+    d->indices = indices;
+    return *this;
+}
+
+QHtmlElementSet& QHtmlElementSet::operator=(const QHtmlElementSet &other) {
+    d->document = other.d->document;
+    d->generation = other.d->generation;
+    d->indices = other.d->indices;
+    return *this;
+}
+
+bool QHtmlElementSet::operator==(const QHtmlElementSet &other) const {
+    const bool empty = isEmpty();
+    
+    if ((empty) || (other.isEmpty())) {
+        return (empty) && (other.isEmpty());
+    }
+    
+    return (d->sameParse(other.d)) && (d->indices == other.d->indices);
+}
+
+bool QHtmlElementSet::operator!=(const QHtmlElementSet &other) const {
+    return !(*this == other);
+}
+
+QHtmlDocument::QHtmlDocument() :
+    d(new QHtmlDocumentPrivate)
+{
+}
+
+QHtmlDocument::QHtmlDocument(const QString &content) :
+    d(new QHtmlDocumentPrivate)
+{
+    setContent(content);
+}
+
+QHtmlDocument::QHtmlDocument(const QByteArray &content) :
+    d(new QHtmlDocumentPrivate)
+{
+    setContent(content);
+}
+
+QHtmlDocument::QHtmlDocument(QIODevice *device) :
+    d(new QHtmlDocumentPrivate)
+{
+    setContent(device);
+}
+
+QHtmlDocument::~QHtmlDocument() {
+    delete d;
+}
+
+bool QHtmlDocument::setContent(const QString &content) {
+    return d->setContent(content.toUtf8());
 }
 
-QHtmlElement QHtmlElement::elementById(const QString &id) const {
-    QHtmlElement element;
-    
-    if (!d->node) {
-        return element;
+bool QHtmlDocument::setContent(const QByteArray &content) {
+    return d->setContent(content);
+}
+
+bool QHtmlDocument::setContent(QIODevice *device) {
+    if (device) {
+        const QFile *file = qobject_cast<QFile*>(device);
+        return d->setContent(device->readAll(), file ? file->fileName() : QString());
     }
     
-    foreach (TidyNode node, allStartNodes(d->node)) {
-        ctmbstr value = nodeAttribute(node, "id");   
-
-        if ((value) && (value == id)) {
-            element.d->document = d->document;
-            element.d->node = node;
-            break;
-        }
+    if (metrics()->isActive()) {
+        metrics()->parseError(DeviceParseError);
     }
     
-    return element;
+    return false;
 }
 
-QHtmlElementList QHtmlElement::elementsByTagName(const QString &name) const {
-    QHtmlElementList elements;
+QHtmlElement QHtmlDocument::documentElement() const {
+    QHtmlElement element;
     
-    if (!d->node) {
-        return elements;
+    if (!d->document) {
+        return element;
     }
     
-    foreach (TidyNode node, allStartNodes(d->node)) {
-        if (tidyNodeGetName(node) == name) {
-            QHtmlElement element;
-            element.d->document = d->document;
-            element.d->node = node;
-            elements << element;
-        }
+    TidyNode root = tidyGetRoot(d->document);
+    
+    if (root) {
+        element.d->document = d->document;
+        element.d->node = root;
     }
-
-    return elements;
-}
-
-QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
-    return elementsByTagName(name, QHtmlAttributeMatches() << match);
+    
+    return element;
 }
 
-QHtmlElementList QHtmlElement::elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
-                                                 QHtmlParser::MatchType matchType) const {
-    QHtmlElementList elements;
+QHtmlElement QHtmlDocument::htmlElement() const {
+    QHtmlElement element;
     
-    if (!d->node) {
-        return elements;
+    if (!d->document) {
+        return element;
     }
     
-    foreach (TidyNode node, allStartNodes(d->node)) {
-        if ((tidyNodeGetName(node) == name) && (matchAttributes(node, matches, matchType))) {
-            QHtmlElement element;
-            element.d->document = d->document;
-            element.d->node = node;
-            elements << element;
-        }
+    TidyNode html = tidyGetHtml(d->document);
+    
+    if (html) {
+        element.d->document = d->document;
+        element.d->node = html;
     }
     
-    return elements;
+    return element;
 }
 
-QHtmlElement QHtmlElement::firstElementByTagName(const QString &name) const {
+QHtmlElement QHtmlDocument::headElement() const {
     QHtmlElement element;
     
-    if (!d->node) {
+    if (!d->document) {
         return element;
     }
     
-    foreach (TidyNode node, allStartNodes(d->node)) {
-        if (tidyNodeGetName(node) == name) {
-            element.d->document = d->document;
-            element.d->node = node;
-            break;
-        }
+    TidyNode head = tidyGetHead(d->document);
+    
+    if (head) {
+        element.d->document = d->document;
+        element.d->node = head;
     }
     
     return element;
 }
 
-QHtmlElement QHtmlElement::firstElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
-    return firstElementByTagName(name, QHtmlAttributeMatches() << match);
-}
-
-QHtmlElement QHtmlElement::firstElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
-                                                 QHtmlParser::MatchType matchType) const {
+QHtmlElement QHtmlDocument::bodyElement() const {
     QHtmlElement element;
     
-    if (!d->node) {
+    if (!d->document) {
         return element;
     }
     
-    foreach (TidyNode node, allStartNodes(d->node)) {
-        if ((tidyNodeGetName(node) == name) && (matchAttributes(node, matches, matchType))) {
-            element.d->document = d->document;
-            element.d->node = node;
-            break;
-        }
+    TidyNode body = tidyGetBody(d->document);
+    
+    if (body) {
+        element.d->document = d->document;
+        element.d->node = body;
     }
     
     return element;
 }
 
-QHtmlElement QHtmlElement::lastElementByTagName(const QString &name) const {
-    const QHtmlElementList elements = elementsByTagName(name);
-
-    if (!elements.isEmpty()) {
-        return elements.last();
+QString QHtmlDocument::toString() const {    
+    if (!d->document) {
+        return QString();
     }
-
-    return QHtmlElement();
-}
-
-QHtmlElement QHtmlElement::lastElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const {
-    const QHtmlElementList elements = elementsByTagName(name, match);
-
-    if (!elements.isEmpty()) {
-        return elements.last();
+    
+    RenderScope scope(d->document, "documentToString");
+    TidyBuffer &buffer = scope.buffer();
+    QMutexLocker locker(scope.printMutex());
+    const int result = tidySaveBuffer(d->document, &buffer);
+    locker.unlock();
+    
+    if (result >= 0) {
+        scope.bytes = buffer.size;
+        return QString::fromUtf8((char *)buffer.bp, buffer.size);
     }
-
-    return QHtmlElement();
+    
+    return QString();
 }
 
-QHtmlElement QHtmlElement::lastElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
-                                                QHtmlParser::MatchType matchType) const {
-    const QHtmlElementList elements = elementsByTagName(name, matches, matchType);
+bool QHtmlDocument::hasError() const {
+    return d->error;
+}
 
-    if (!elements.isEmpty()) {
-        return elements.last();
-    }
+QString QHtmlDocument::errorString() const {
+    return d->errorString;
+}
 
-    return QHtmlElement();
+QHtmlParserStats QHtmlDocument::stats() const {
+    QMutexLocker locker(&d->statsMutex);
+    return d->stats;
 }
 
-QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name) const {
-    if (n == 0) {
-        return firstElementByTagName(name);
+QHtmlTextFingerprint QHtmlDocument::textFingerprint(int minHashCount) const {
+    if (!d->document) {
+        return QHtmlTextFingerprint();
     }
     
-    QHtmlElement element;
+    TidyNode node = tidyGetBody(d->document);
     
-    if (!d->node) {
-        return element;
+    if (!node) {
+        node = tidyGetRoot(d->document);
     }
     
-    const QList<TidyNode> nodes = allStartNodes(d->node);
+    FingerprintSink sink(minHashCount);
+    tokenizeText(d->document, node, sink);
+    return sink.fingerprint();
+}
 
-    if (nodes.isEmpty()) {
-        return element;
+QHtmlDocumentStatistics QHtmlDocument::statistics() const {
+    if (!d->document) {
+        return QHtmlDocumentStatistics();
     }
+    
+    StatisticsCollector collector(d->document);
+    collector.collect(tidyGetRoot(d->document), 1, TidyTag_UNKNOWN);
+    return collector.result();
+}
 
-    const int start = (n < 0 ? nodes.size() - 1 : 0);
-    const int end = (n < 0 ? 0 : nodes.size() - 1);
-    int inc = (n < 0 ? -1 : 1);
-    int hits = 0;
-
-    for (int i = start; i != end; i += inc) {
-        if (tidyNodeGetName(nodes.at(i)) == name) {
-            if (hits == n) {
-                element.d->document = d->document;
-                element.d->node = nodes.at(i);
-                break;
-            }
+bool QHtmlDocument::isQueryCacheEnabled() const {
+    return d->isQueryCacheEnabled();
+}
 
-            hits += inc;
-        }
+void QHtmlDocument::setQueryCacheEnabled(bool enabled) {
+    QMutexLocker locker(&d->mutex);
+    d->queryCacheEnabled = enabled;
+    
+    if (!enabled) {
+        d->queryResults.clear();
     }
     
-    return element;
+    locker.unlock();
+    d->recordOptions();
 }
 
-QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name, const QHtmlAttributeMatch &match) const {
-    return nthElementByTagName(n, name, QHtmlAttributeMatches() << match);
+bool QHtmlDocument::isAttributeIndexEnabled() const {
+    QMutexLocker locker(&d->mutex);
+    return d->attributeIndexEnabled;
 }
 
-QHtmlElement QHtmlElement::nthElementByTagName(int n, const QString &name, const QHtmlAttributeMatches &matches,
-                                               QHtmlParser::MatchType matchType) const {
-    if (n == 0) {
-        return firstElementByTagName(name, matches, matchType);
+void QHtmlDocument::setAttributeIndexEnabled(bool enabled) {
+    QMutexLocker locker(&d->mutex);
+    d->attributeIndexEnabled = enabled;
+    
+    if (!enabled) {
+        d->attributeIndex.clear();
+        d->attributeIndexBuilt = false;
     }
     
-    QHtmlElement element;
+    locker.unlock();
+    d->recordOptions();
+}
+
+QStringList QHtmlDocument::valueIndexedAttributes() const {
+    QMutexLocker locker(&d->mutex);
+    QStringList names;
     
-    if (!d->node) {
-        return element;
+    foreach (const QByteArray &name, d->valueIndexedAttributes) {
+        names << QString::fromUtf8(name);
     }
     
-    const QList<TidyNode> nodes = allStartNodes(d->node);
+    return names;
+}
 
-    if (nodes.isEmpty()) {
-        return element;
+void QHtmlDocument::setValueIndexedAttributes(const QStringList &names) {
+    QMutexLocker locker(&d->mutex);
+    d->valueIndexedAttributes.clear();
+    
+    foreach (const QString &name, names) {
+        d->valueIndexedAttributes << name.toUtf8();
     }
     
-    const int start = (n < 0 ? nodes.size() - 1 : 0);
-    const int end = (n < 0 ? 0 : nodes.size() - 1);
-    int inc = (n < 0 ? -1 : 1);
-    int hits = 0;
+    d->valueIndexes.clear();
+    d->valueIndexesBuilt = false;
+    locker.unlock();
+    d->recordOptions();
+}
 
-    for (int i = start; i != end; i += inc) {
-        if ((tidyNodeGetName(nodes.at(i)) == name) && (matchAttributes(nodes.at(i), matches, matchType))) {
-            if (hits == n) {
-                element.d->document = d->document;
-                element.d->node = nodes.at(i);
-                break;
-            }
+bool QHtmlDocument::isTextIndexEnabled() const {
+    QMutexLocker locker(&d->mutex);
+    return d->textIndexEnabled;
+}
 
-            hits += inc;
-        }
+void QHtmlDocument::setTextIndexEnabled(bool enabled) {
+    QMutexLocker locker(&d->mutex);
+    d->textIndexEnabled = enabled;
+    
+    if (!enabled) {
+        d->clearTextIndex();
     }
     
-    return element;
+    locker.unlock();
+    d->recordOptions();
 }
 
-QString QHtmlElement::tagName() const {
-    if (d->node) {
-        return tidyNodeGetName(d->node);
+QHtmlElementList QHtmlDocument::elementsContainingText(const QString &text) const {
+    QHtmlElementList elements;
+    
+    if (!d->document) {
+        return elements;
     }
     
-    return QString();
-}
-
-QString QHtmlElement::text(bool includeChildElements) const {    
-    if ((!d->document) || (!d->node)) {
-        return QString();
+    if (recorder()->isActive()) {
+        recorder()->recordQuery(d->id, tidyGetRoot(d->document), "elementsContainingText",
+                                QList<QByteArray>() << QUrl::toPercentEncoding(text));
     }
     
-    TidyBuffer buffer = TidyBuffer();
-
-    if (includeChildElements) {
-        foreach (TidyNode node, allTextNodes(d->node)) {
-            tidyNodeGetText(d->document, node, &buffer);
+    QueryScope scope(d->document, "elementsContainingText");
+    const QByteArray utf8 = text.toUtf8();
+    TermSink terms;
+    QByteArray token;
+    tokenizeBytes(reinterpret_cast<const uchar*>(utf8.constData()), utf8.size(), 0, token, terms);
+    
+    if (terms.tokens.isEmpty()) {
+        return elements;
+    }
+    
+    QList<TextSpan> spans;
+    d->ensureTextIndex();
+    // The index may be disabled and discarded by another thread, so it is only read under the lock.
+    QMutexLocker locker(&d->mutex);
+    const int generation = d->generation;
+    
+    if (d->textIndexBuilt) {
+        const int count = terms.tokens.size();
+        QVector<int> ids(count);
+        int rarest = 0;
+        
+        for (int i = 0; i < count; ++i) {
+            const QHash<QByteArray, int>::const_iterator iterator = d->tokenIds.constFind(terms.tokens.at(i));
+            
+            if (iterator == d->tokenIds.constEnd()) {
+                return elements;
+            }
+            
+            ids[i] = iterator.value();
+            
+            if (d->tokenPostings.at(ids.at(i)).size() < d->tokenPostings.at(ids.at(rarest)).size()) {
+                rarest = i;
+            }
+        }
+        
+        // Verifies the other tokens around each position of the least common token of the phrase.
+        foreach (const int position, d->tokenPostings.at(ids.at(rarest))) {
+            const int start = position - rarest;
+            
+            if ((start < 0) || (start + count > d->tokenSequence.size())) {
+                continue;
+            }
+            
+            int i = 0;
+            
+            while ((i < count) && (d->tokenSequence.at(start + i) == ids.at(i))) {
+                ++i;
+            }
+            
+            if (i == count) {
+                spans << TextSpan(d->tokenNodes.at(start), d->tokenNodes.at(start + count - 1));
+            }
         }
     }
     else {
-        foreach (TidyNode node, allTextNodes(d->node)) {
-            if (tidyGetParent(node) == d->node) {
-                tidyNodeGetText(d->document, node, &buffer);
-                break;
-            }
+        locker.unlock();
+        PhraseSink sink(terms.tokens);
+        tokenizeText(d->document, tidyGetRoot(d->document), sink);
+        spans = sink.spans;
+    }
+    
+    locker.unlock();
+    
+    if (spans.isEmpty()) {
+        return elements;
+    }
+    
+    d->ensureOrderIndex();
+    QVector<int> positions;
+    positions.reserve(spans.size());
+    locker.relock();
+    
+    if (d->generation != generation) {
+        return elements;
+    }
+    
+    foreach (const TextSpan &span, spans) {
+        const TidyNode node = d->enclosingElement(span.first, span.second);
+        
+        if (node) {
+            positions << d->nodeIndices.value(node);
         }
     }
     
-    if (buffer.bp) {
-        QString text = QString::fromUtf8((char*)buffer.bp);
-        tidyBufFree(&buffer);
+    std::sort(positions.begin(), positions.end());
+    positions.resize(std::unique(positions.begin(), positions.end()) - positions.begin());
+    elements.reserve(positions.size());
+    
+    foreach (const int position, positions) {
+        scope.counters.match();
+        QHtmlElement element;
+        element.d->document = d->document;
+        element.d->node = d->orderedNodes.at(position);
+        elements << element;
+    }
+    
+    return elements;
+}
+
+bool QHtmlDocument::isNull() const {
+    return d->document ? false : true;
+}
+
+bool QHtmlParser::startRecording(QIODevice *device, RecordingMode mode) {
+    return recorder()->start(device, mode);
+}
+
+void QHtmlParser::stopRecording() {
+    recorder()->stop();
+}
 
-        if (text.endsWith("\n")) {
-            text.chop(1);
-        }
+bool QHtmlParser::isRecording() {
+    return recorder()->isActive();
+}
 
-        return text;
-    }
-    
-    return QString();
+void QHtmlParser::setSlowDocumentHandler(SlowDocumentHandler handler, const QHtmlSlowDocumentLimits &limits,
+                                         void *userData) {
+    monitor()->setHandler(handler, limits, userData);
 }
 
-QString QHtmlElement::toString() const {    
-    if ((!d->document) || (!d->node)) {
-        return QString();
-    }
-    
-    TidyBuffer buffer = TidyBuffer();
-    
-    if (tidyNodeGetText(d->document, d->node, &buffer)) {
-        QString text = QString::fromUtf8((char *)buffer.bp);
-        tidyBufFree(&buffer);        
-        return text.trimmed();
-    }
-    
-    return QString();
+void QHtmlParser::setMetricsEnabled(bool enabled) {
+    metrics()->setActive(enabled);
 }
 
-bool QHtmlElement::isNull() const {
-    return (!d->document) || (!d->node);
+bool QHtmlParser::metricsEnabled() {
+    return metrics()->isActive();
 }
 
-QHtmlElement& QHtmlElement::operator=(const QHtmlElement &other) {
-    d->document = other.d->document;
-    d->node = other.d->node;
-    return *this;
+QByteArray QHtmlParser::metricsText() {
+    return metrics()->text();
 }
 
-bool QHtmlElement::operator==(const QHtmlElement &other) const {
-    return (other.d->document == d->document) && (other.d->node == d->node);
+bool QHtmlParser::startTracing(QIODevice *device) {
+    return tracer()->start(device);
 }
 
-bool QHtmlElement::operator!=(const QHtmlElement &other) const {
-    return (other.d->document != d->document) || (other.d->node != d->node);
+void QHtmlParser::stopTracing() {
+    tracer()->stop();
 }
 
-class QHtmlDocumentPrivate
+bool QHtmlParser::isTracing() {
+    return tracer()->isActive();
+}
+
+QStringList QHtmlParser::attributeColumn(const QHtmlElementList &elements, const QString &name) {
+    QStringList column;
+    column.reserve(elements.size());
+    const QByteArray attributeName = name.toUtf8();
+    
+    foreach (const QHtmlElement &element, elements) {
+        ctmbstr value = 0;
+        
+        if (element.d->node) {
+            for (TidyAttr attr = tidyAttrFirst(element.d->node); attr; attr = tidyAttrNext(attr)) {
+                if (qstrcmp(tidyAttrName(attr), attributeName.constData()) == 0) {
+                    value = tidyAttrValue(attr);
+                    break;
+                }
+            }
+        }
+        
+        column << (value ? QString::fromUtf8(value) : QString());
+    }
+    
+    return column;
+}
+
+QStringList QHtmlParser::textColumn(const QHtmlElementList &elements, bool includeChildElements) {
+    QStringList column;
+    column.reserve(elements.size());
+    TidyDoc document = 0;
+    RenderScope *scope = 0;
+    
+    foreach (const QHtmlElement &element, elements) {
+        if ((!element.d->document) || (!element.d->node)) {
+            column << QString();
+            continue;
+        }
+        
+        if (element.d->document != document) {
+            delete scope;
+            document = element.d->document;
+            scope = new RenderScope(document, "textColumn");
+        }
+        
+        TidyBuffer &buffer = scope->buffer();
+        QMutexLocker locker(scope->printMutex());
+        appendText(document, element.d->node, includeChildElements, buffer);
+        locker.unlock();
+        scope->bytes += buffer.size;
+        column << bufferText(buffer);
+    }
+    
+    delete scope;
+    return column;
+}
+
+class QHtmlDocumentCachePrivate
 {
 
 public:
-    QHtmlDocumentPrivate() :
-        document(0),
-        error(false)
+    struct Entry
+    {
+        QByteArray digest;
+        qint64 cost;
+        QSharedPointer<const QHtmlDocument> document;
+        Entry *previous;
+        Entry *next;
+    };
+    
+    explicit QHtmlDocumentCachePrivate(qint64 max) :
+        maxCost(max),
+        totalCost(0),
+        first(0),
+        last(0)
     {
     }
     
-    ~QHtmlDocumentPrivate() {
-        if (document) {
-            tidyRelease(document);
-        }
+    ~QHtmlDocumentCachePrivate() {
+        clear();
     }
     
-    bool setContent(const QByteArray &content) {
-        if (document) {
-            tidyRelease(document);
+    void unlink(Entry *entry) {
+        if (entry->previous) {
+            entry->previous->next = entry->next;
+        }
+        else {
+            first = entry->next;
         }
         
-        document = tidyCreate();
-        tidySetCharEncoding(document, "utf8");
-        tidyOptSetBool(document, TidyForceOutput, yes);
-        tidyOptSetInt(document, TidyWrapLen, 0);
-        tidyOptSetBool(document, TidyQuiet, yes);
-        tidyOptSetBool(document, TidyShowWarnings, no);
-        
-        TidyBuffer errorBuffer = TidyBuffer();
-        tidySetErrorBuffer(document, &errorBuffer);
-        tidyParseString(document, content.constData());
-        error = tidyErrorCount(document) > 0;
+        if (entry->next) {
+            entry->next->previous = entry->previous;
+        }
+        else {
+            last = entry->previous;
+        }
+    }
+    
+    void prepend(Entry *entry) {
+        entry->previous = 0;
+        entry->next = first;
         
-        if (error) {
-            errorString = QString::fromUtf8((char*)errorBuffer.bp);
-            tidyBufFree(&errorBuffer);
+        if (first) {
+            first->previous = entry;
         }
         else {
-            errorString = QString();
+            last = entry;
         }
         
-        return !error;
+        first = entry;
     }
     
-    TidyDoc document;
+    void remove(Entry *entry) {
+        unlink(entry);
+        entries.remove(entry->digest);
+        totalCost -= entry->cost;
+        delete entry;
+    }
     
-    bool error;
-    QString errorString;
+    void trim() {
+        while ((last) && (totalCost > maxCost)) {
+            remove(last);
+        }
+    }
+    
+    void clear() {
+        while (last) {
+            remove(last);
+        }
+    }
+    
+    QMutex mutex;
+    QHash<QByteArray, Entry*> entries;
+    QHtmlDocumentOptions options;
+    qint64 maxCost;
+    qint64 totalCost;
+    Entry *first;
+    Entry *last;
 };
 
-QHtmlDocument::QHtmlDocument() :
-    d(new QHtmlDocumentPrivate)
+QHtmlDocumentCache::QHtmlDocumentCache(qint64 maxCost) :
+    d(new QHtmlDocumentCachePrivate(maxCost))
 {
 }
 
-QHtmlDocument::QHtmlDocument(const QString &content) :
-    d(new QHtmlDocumentPrivate)
-{
-    setContent(content);
+QHtmlDocumentCache::~QHtmlDocumentCache() {
+    delete d;
 }
 
-QHtmlDocument::QHtmlDocument(const QByteArray &content) :
-    d(new QHtmlDocumentPrivate)
-{
-    setContent(content);
+QSharedPointer<const QHtmlDocument> QHtmlDocumentCache::document(const QByteArray &content) {
+    // A cryptographic digest rather than a fast hash, so that content is hard to craft to collide with a 
+    // cached document. Qt 4 only offers SHA-1, against which chosen-prefix collisions are practical.
+#if QT_VERSION >= 0x050000
+    const QByteArray digest = QCryptographicHash::hash(content, QCryptographicHash::Sha256);
+#else
+    const QByteArray digest = QCryptographicHash::hash(content, QCryptographicHash::Sha1);
+#endif
+    QMutexLocker locker(&d->mutex);
+    QHtmlDocumentCachePrivate::Entry *entry = d->entries.value(digest);
+    
+    if (entry) {
+        d->unlink(entry);
+        d->prepend(entry);
+        return entry->document;
+    }
+    
+    const QHtmlDocumentOptions options = d->options;
+    locker.unlock();
+    QHtmlDocument *document = new QHtmlDocument(content);
+    document->setQueryCacheEnabled(options.queryCacheEnabled);
+    document->setAttributeIndexEnabled(options.attributeIndexEnabled);
+    document->setValueIndexedAttributes(options.valueIndexedAttributes);
+    document->setTextIndexEnabled(options.textIndexEnabled);
+    const QSharedPointer<const QHtmlDocument> shared(document);
+    int nodeCount = 0;
+    int maxDepth = 0;
+    
+    if (document->d->document) {
+        countNodes(tidyGetRoot(document->d->document), 1, nodeCount, maxDepth);
+    }
+    
+    /*
+     * Rough estimate of the memory used by tidy. The lexer keeps a buffer holding the text of the 
+     * content. For each node, tidy allocates a Node structure (about 100 bytes on 64-bit platforms) 
+     * and a copy of its tag name, and for each attribute an AttVal with copies of its name and value. 
+     * 128 bytes per node approximates this for typical markup; it is not measured. The indexes, which 
+     * are built on demand, are not included.
+     */
+    const qint64 cost = content.size() + qint64(nodeCount) * 128;
+    locker.relock();
+    
+    if (cost <= d->maxCost) {
+        entry = d->entries.value(digest);
+        
+        if (entry) {
+            d->remove(entry);
+        }
+        
+        entry = new QHtmlDocumentCachePrivate::Entry;
+        entry->digest = digest;
+        entry->cost = cost;
+        entry->document = shared;
+        d->prepend(entry);
+        d->entries.insert(digest, entry);
+        d->totalCost += cost;
+        d->trim();
+    }
+    
+    return shared;
 }
 
-QHtmlDocument::QHtmlDocument(QIODevice *device) :
-    d(new QHtmlDocumentPrivate)
-{
-    setContent(device);
+QHtmlDocumentOptions QHtmlDocumentCache::documentOptions() const {
+    QMutexLocker locker(&d->mutex);
+    return d->options;
 }
 
-QHtmlDocument::~QHtmlDocument() {
-    delete d;
+void QHtmlDocumentCache::setDocumentOptions(const QHtmlDocumentOptions &options) {
+    QMutexLocker locker(&d->mutex);
+    d->options = options;
 }
 
-bool QHtmlDocument::setContent(const QString &content) {
-    return d->setContent(content.toUtf8());
+qint64 QHtmlDocumentCache::maxCost() const {
+    QMutexLocker locker(&d->mutex);
+    return d->maxCost;
 }
 
-bool QHtmlDocument::setContent(const QByteArray &content) {
-    return d->setContent(content);
+void QHtmlDocumentCache::setMaxCost(qint64 maxCost) {
+    QMutexLocker locker(&d->mutex);
+    d->maxCost = maxCost;
+    d->trim();
 }
 
-bool QHtmlDocument::setContent(QIODevice *device) {
-    if (device) {
-        return d->setContent(device->readAll());
-    }
-    
-    return false;
+qint64 QHtmlDocumentCache::totalCost() const {
+    QMutexLocker locker(&d->mutex);
+    return d->totalCost;
 }
 
-QHtmlElement QHtmlDocument::documentElement() const {
-    QHtmlElement element;
-    
-    if (!d->document) {
-        return element;
-    }
-    
-    TidyNode root = tidyGetRoot(d->document);
-    
-    if (root) {
-        element.d->document = d->document;
-        element.d->node = root;
-    }
-    
-    return element;
+int QHtmlDocumentCache::count() const {
+    QMutexLocker locker(&d->mutex);
+    return d->entries.size();
 }
 
-QHtmlElement QHtmlDocument::htmlElement() const {
-    QHtmlElement element;
-    
-    if (!d->document) {
-        return element;
+void QHtmlDocumentCache::clear() {
+    QMutexLocker locker(&d->mutex);
+    d->clear();
+}
+
+class QHtmlDiffBuilder
+{
+
+public:
+    QHtmlDiffBuilder(TidyDoc oldDocument, TidyDoc newDocument, QHtmlDiff &diff) :
+        oldDoc(oldDocument),
+        newDoc(newDocument),
+        oldPrivate(documentPrivate(oldDocument)),
+        newPrivate(documentPrivate(newDocument)),
+        result(diff)
+    {
     }
     
-    TidyNode html = tidyGetHtml(d->document);
-    
-    if (html) {
-        element.d->document = d->document;
-        element.d->node = html;
+    static void run(const QHtmlElement &oldRoot, const QHtmlElement &newRoot, QHtmlDiff &diff) {
+        QHtmlDiffBuilder builder(oldRoot.d->document, newRoot.d->document, diff);
+        builder.compare(oldRoot.d->node, newRoot.d->node);
     }
-    
-    return element;
-}
 
-QHtmlElement QHtmlDocument::headElement() const {
-    QHtmlElement element;
+private:
+    void compare(TidyNode oldNode, TidyNode newNode) {
+        if (oldPrivate->contentHash(oldNode) == newPrivate->contentHash(newNode)) {
+            return;
+        }
+        
+        QHtmlElementChange change;
+        compareAttributes(oldNode, newNode, change);
+        QList<TidyNode> oldChildren;
+        QList<TidyNode> newChildren;
+        QList<quint64> oldText;
+        QList<quint64> newText;
+        split(oldNode, oldPrivate, oldChildren, oldText);
+        split(newNode, newPrivate, newChildren, newText);
+        change.textChanged = (oldText != newText);
+        
+        if ((change.textChanged) || (!change.insertedAttributes.isEmpty()) || (!change.removedAttributes.isEmpty())
+            || (!change.changedAttributes.isEmpty())) {
+            change.oldElement = element(oldDoc, oldNode);
+            change.newElement = element(newDoc, newNode);
+            result.changedElements << change;
+        }
+        
+        compareChildren(oldChildren, newChildren);
+    }
     
-    if (!d->document) {
+    QHtmlElement element(TidyDoc document, TidyNode node) const {
+        QHtmlElement element;
+        element.d->document = document;
+        element.d->node = node;
         return element;
     }
     
-    TidyNode head = tidyGetHead(d->document);
-    
-    if (head) {
-        element.d->document = d->document;
-        element.d->node = head;
+    static TidyAttr findAttribute(TidyNode node, ctmbstr name) {
+        for (TidyAttr attr = tidyAttrFirst(node); attr; attr = tidyAttrNext(attr)) {
+            if (qstrcmp(tidyAttrName(attr), name) == 0) {
+                return attr;
+            }
+        }
+        
+        return 0;
     }
     
-    return element;
-}
-
-QHtmlElement QHtmlDocument::bodyElement() const {
-    QHtmlElement element;
-    
-    if (!d->document) {
-        return element;
+    static bool canPair(TidyNode oldNode, TidyNode newNode) {
+        return (qstrcmp(tidyNodeGetName(oldNode), tidyNodeGetName(newNode)) == 0)
+            && (qstrcmp(nodeAttribute(oldNode, "id"), nodeAttribute(newNode, "id")) == 0);
     }
     
-    TidyNode body = tidyGetBody(d->document);
+    static void compareAttributes(TidyNode oldNode, TidyNode newNode, QHtmlElementChange &change) {
+        for (TidyAttr attr = tidyAttrFirst(oldNode); attr; attr = tidyAttrNext(attr)) {
+            const TidyAttr other = findAttribute(newNode, tidyAttrName(attr));
+            
+            if (!other) {
+                change.removedAttributes << QHtmlAttribute(tidyAttrName(attr), tidyAttrValue(attr));
+            }
+            else if (qstrcmp(tidyAttrValue(attr), tidyAttrValue(other)) != 0) {
+                change.changedAttributes << QHtmlAttribute(tidyAttrName(other), tidyAttrValue(other));
+            }
+        }
+        
+        for (TidyAttr attr = tidyAttrFirst(newNode); attr; attr = tidyAttrNext(attr)) {
+            if (!findAttribute(oldNode, tidyAttrName(attr))) {
+                change.insertedAttributes << QHtmlAttribute(tidyAttrName(attr), tidyAttrValue(attr));
+            }
+        }
+    }
     
-    if (body) {
-        element.d->document = d->document;
-        element.d->node = body;
+    static void split(TidyNode node, QHtmlDocumentPrivate *dp, QList<TidyNode> &elements, QList<quint64> &text) {
+        for (TidyNode child = tidyGetChild(node); child; child = tidyGetNext(child)) {
+            const TidyNodeType type = tidyNodeGetType(child);
+            
+            if ((type == TidyNode_Start) || (type == TidyNode_StartEnd)) {
+                elements << child;
+            }
+            else {
+                text << dp->contentHash(child);
+            }
+        }
     }
     
-    return element;
-}
-
-QString QHtmlDocument::toString() const {    
-    if (!d->document) {
-        return QString();
+    void compareChildren(const QList<TidyNode> &oldChildren, const QList<TidyNode> &newChildren) {
+        QList<quint64> oldHashes;
+        QList<quint64> newHashes;
+        
+        foreach (TidyNode node, oldChildren) {
+            oldHashes << oldPrivate->contentHash(node);
+        }
+        
+        foreach (TidyNode node, newChildren) {
+            newHashes << newPrivate->contentHash(node);
+        }
+        
+        // Skip identical leading and trailing children before pairing the rest.
+        int begin = 0;
+        int oldEnd = oldChildren.size();
+        int newEnd = newChildren.size();
+        
+        while ((begin < oldEnd) && (begin < newEnd) && (oldHashes.at(begin) == newHashes.at(begin))) {
+            ++begin;
+        }
+        
+        while ((oldEnd > begin) && (newEnd > begin) && (oldHashes.at(oldEnd - 1) == newHashes.at(newEnd - 1))) {
+            --oldEnd;
+            --newEnd;
+        }
+        
+        QMultiHash<quint64, int> unpaired;
+        QVector<bool> paired(oldEnd - begin, false);
+        QList<int> pending;
+        
+        for (int i = oldEnd - 1; i >= begin; --i) {
+            unpaired.insert(oldHashes.at(i), i);
+        }
+        
+        for (int i = begin; i < newEnd; ++i) {
+            const QMultiHash<quint64, int>::iterator iterator = unpaired.find(newHashes.at(i));
+            
+            if (iterator != unpaired.end()) {
+                paired[iterator.value() - begin] = true;
+                unpaired.erase(iterator);
+            }
+            else {
+                pending << i;
+            }
+        }
+        
+        foreach (int i, pending) {
+            int match = -1;
+            
+            for (int j = begin; j < oldEnd; ++j) {
+                if ((!paired.at(j - begin)) && (canPair(oldChildren.at(j), newChildren.at(i)))) {
+                    match = j;
+                    break;
+                }
+            }
+            
+            if (match >= 0) {
+                paired[match - begin] = true;
+                compare(oldChildren.at(match), newChildren.at(i));
+            }
+            else {
+                result.insertedElements << element(newDoc, newChildren.at(i));
+            }
+        }
+        
+        for (int j = begin; j < oldEnd; ++j) {
+            if (!paired.at(j - begin)) {
+                result.removedElements << element(oldDoc, oldChildren.at(j));
+            }
+        }
     }
     
-    TidyBuffer buffer = TidyBuffer();
+    TidyDoc oldDoc;
+    TidyDoc newDoc;
+    QHtmlDocumentPrivate *oldPrivate;
+    QHtmlDocumentPrivate *newPrivate;
+    QHtmlDiff &result;
+};
+
+QHtmlDiff QHtmlDiff::compute(const QHtmlDocument &oldDocument, const QHtmlDocument &newDocument) {
+    QHtmlDiff diff;
+    const QHtmlElement oldRoot = oldDocument.documentElement();
+    const QHtmlElement newRoot = newDocument.documentElement();
     
-    if (tidySaveBuffer(d->document, &buffer) >= 0) {
-        QString text = QString::fromUtf8((char *)buffer.bp);
-        tidyBufFree(&buffer);
-        return text;
+    if (oldRoot.isNull()) {
+        if (!newRoot.isNull()) {
+            diff.insertedElements << newRoot;
+        }
+    }
+    else if (newRoot.isNull()) {
+        diff.removedElements << oldRoot;
+    }
+    else {
+        QHtmlDiffBuilder::run(oldRoot, newRoot, diff);
     }
     
-    return QString();
-}
-
-bool QHtmlDocument::hasError() const {
-    return d->error;
-}
-
-QString QHtmlDocument::errorString() const {
-    return d->errorString;
+    return diff;
 }
 
-bool QHtmlDocument::isNull() const {
-    return d->document ? false : true;
+bool QHtmlDiff::isEmpty() const {
+    return (insertedElements.isEmpty()) && (removedElements.isEmpty()) && (changedElements.isEmpty());
 }
@@ -19,8 +19,15 @@
 #ifndef QHTMLPARSER_H
 #define QHTMLPARSER_H
 
+#include <QByteArray>
+#include <QHash>
 #include <QList>
+#include <QSharedPointer>
 #include <QString>
+#include <QStringList>
+#include <QVector>
+
+class QIODevice;
 
 #if defined(QHTMLPARSER_LIBRARY)
 #define QHTMLPARSER_EXPORT Q_DECL_EXPORT
@@ -109,6 +116,44 @@
  * ...
  * \endcode
  *
+ * \subsection probes Static Tracepoints
+ *
+ * When built with <tt>CONFIG+=qhtmlparser_usdt</tt> (which defines QHTMLPARSER_USDT and requires sys/sdt.h), 
+ * the library contains USDT probes in the 'qhtmlparser' provider that can be attached to using perf or bpftrace:
+ *
+ * <table>
+ *     <tr>
+ *         <th>Probe</th>
+ *         <th>Arguments</th>
+ *     </tr>
+ *     <tr>
+ *         <td>parse__start</td>
+ *         <td>document id, bytes</td>
+ *     </tr>
+ *     <tr>
+ *         <td>parse__done</td>
+ *         <td>document id, bytes, node count, error</td>
+ *     </tr>
+ *     <tr>
+ *         <td>query__start</td>
+ *         <td>document id, function name</td>
+ *     </tr>
+ *     <tr>
+ *         <td>query__done</td>
+ *         <td>document id, function name, elements visited, matches</td>
+ *     </tr>
+ *     <tr>
+ *         <td>render__start</td>
+ *         <td>document id, function name</td>
+ *     </tr>
+ *     <tr>
+ *         <td>render__done</td>
+ *         <td>document id, function name, bytes</td>
+ *     </tr>
+ * </table>
+ *
+ * The node count of parse__done is only computed while a tracer is attached to the probe.
+ *
  * \subsection source Source Code
  *
  * The source code can be found at <a href="https://github.com/marxoft/qhtmlparser">GitHub</a>.
@@ -178,9 +223,197 @@ namespace QHtmlParser
          */
         MatchAny = 1
     };
+
+    /*!
+     * Specifies how the candidate elements of a query are found.
+     *
+     * \sa QHtmlElement::explain()
+     */
+    enum QueryStrategy {
+        /*!
+         * Every descendant element of the searched element is examined.
+         */
+        FullScan = 0,
+
+        /*!
+         * Only the elements that have the least common of the matched attributes are examined, 
+         * using the attribute index of the document.
+         *
+         * \sa QHtmlDocument::setAttributeIndexEnabled()
+         */
+        AttributeIndex = 1,
+
+        /*!
+         * Only the elements whose value of a matched attribute equals, or starts with, the matched 
+         * value are examined, using a value index of the document.
+         *
+         * \sa QHtmlDocument::setValueIndexedAttributes()
+         */
+        ValueIndex = 2
+    };
+
+    /*!
+     * Returned by the visitor passed to QHtmlElement::visit() to control the traversal.
+     */
+    enum VisitResult {
+        /*!
+         * The traversal continues with the children of the visited element.
+         */
+        ContinueVisit = 0,
+
+        /*!
+         * The traversal continues after the visited element, skipping its descendants.
+         */
+        SkipChildren = 1,
+
+        /*!
+         * The traversal stops.
+         */
+        StopVisit = 2
+    };
+
+    /*!
+     * Specifies how documents are written to a recording.
+     *
+     * \sa startRecording()
+     */
+    enum RecordingMode {
+        /*!
+         * Only the SHA-1 hash, size and file path (if known) of each document are recorded.
+         */
+        RecordContentHash = 0,
+
+        /*!
+         * The content of each document is recorded in addition to its hash, size and file path.
+         */
+        RecordContent = 1
+    };
+
+    /*!
+     * Starts recording parsed documents and the queries made against them to \a device.
+     *
+     * The device must be open for writing and must remain valid until stopRecording() is called. 
+     * The recording is a UTF-8 text file with one tab-separated record per line:
+     *
+     * \code
+     * document <id> <sha1> <size> <path> [<base64 content>]
+     * options <id> <query cache> <attribute index> <text index> <value-indexed attributes>
+     * query <id> <element path> <function> <arguments>...
+     * release <id>
+     * \endcode
+     *
+     * An options record follows each document record, and is written again whenever the query options of
+     * that document are changed. Its flags are 0 or 1, and the value-indexed attribute names are comma-separated.
+     * Strings are percent-encoded, and the element path is the list of child element 
+     * indices leading from QHtmlDocument::documentElement() to the element that was searched, e.g. '/0/1/3'. 
+     * Queries of the whole document, such as QHtmlDocument::elementsContainingText(), use the path '/'. 
+     * Traversals with QHtmlElement::visit(), findFirst() and findAll() are not recorded, as their 
+     * callables cannot be replayed.
+     *
+     * Calling startRecording() while a recording is active stops that recording first.
+     *
+     * The qhtmlreplay tool can be used to re-execute a recording for profiling purposes.
+     *
+     * Returns \c true if recording was started.
+     *
+     * \sa stopRecording(), isRecording()
+     */
+    QHTMLPARSER_EXPORT bool startRecording(QIODevice *device, RecordingMode mode = RecordContentHash);
+
+    /*!
+     * Stops any recording started using startRecording().
+     */
+    QHTMLPARSER_EXPORT void stopRecording();
+
+    /*!
+     * Returns \c true if documents and queries are currently being recorded.
+     */
+    QHTMLPARSER_EXPORT bool isRecording();
+
+    /*!
+     * Starts writing trace events for parsing, queries, text extraction and index builds to \a device.
+     *
+     * The device must be open for writing and must remain valid until stopTracing() is called. 
+     * Events are written in the Chrome trace event format (a JSON array of complete events), 
+     * which can be loaded into chrome://tracing or the Perfetto UI. Each event carries the 
+     * process and thread id, and the id of the document it relates to. Index builds are written 
+     * with the category 'index' and the number of entries indexed. Timestamps are relative to the 
+     * start of the trace, and operations that began before it are not written.
+     *
+     * Calling startTracing() while tracing is active terminates the previous trace first.
+     *
+     * Returns \c true if tracing was started.
+     *
+     * \sa stopTracing(), isTracing()
+     */
+    QHTMLPARSER_EXPORT bool startTracing(QIODevice *device);
+
+    /*!
+     * Stops any tracing started using startTracing() and terminates the JSON array.
+     */
+    QHTMLPARSER_EXPORT void stopTracing();
+
+    /*!
+     * Returns \c true if trace events are currently being written.
+     */
+    QHTMLPARSER_EXPORT bool isTracing();
+
+    /*!
+     * Sets whether the library collects metrics to \a enabled.
+     *
+     * Metrics are disabled by default. Once enabled, the library maintains lock-free counters of 
+     * documents and bytes parsed, parse errors by class ('tidy', 'fatal' and 'device'), and 
+     * histograms of parse latency and query latency by function.
+     *
+     * \sa metricsText()
+     */
+    QHTMLPARSER_EXPORT void setMetricsEnabled(bool enabled);
+
+    /*!
+     * Returns \c true if metrics are being collected.
+     */
+    QHTMLPARSER_EXPORT bool metricsEnabled();
+
+    /*!
+     * Returns the metrics collected since the library was loaded, in the Prometheus text exposition format.
+     *
+     * \sa setMetricsEnabled()
+     */
+    QHTMLPARSER_EXPORT QByteArray metricsText();
+
+    /*!
+     * Specifies why a QHtmlSlowDocumentEvent was raised.
+     */
+    enum SlowDocumentReason {
+        /*!
+         * Parsing took longer than QHtmlSlowDocumentLimits::parseTime.
+         */
+        SlowParse = 0x0001,
+
+        /*!
+         * A query took longer than QHtmlSlowDocumentLimits::queryTime.
+         */
+        SlowQuery = 0x0002,
+
+        /*!
+         * The parsed document has more nodes than QHtmlSlowDocumentLimits::nodeCount.
+         */
+        TooManyNodes = 0x0004,
+
+        /*!
+         * The parsed document is nested more deeply than QHtmlSlowDocumentLimits::maxDepth.
+         */
+        TooDeep = 0x0008
+    };
+
+    /*!
+     * Typedef for QFlags<SlowDocumentReason>.
+     */
+    typedef QFlags<SlowDocumentReason> SlowDocumentReasons;
 }
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(QHtmlParser::MatchFlags)
+Q_DECLARE_OPERATORS_FOR_FLAGS(QHtmlParser::SlowDocumentReasons)
 
 /*!
  * Represents a HTML attribute with a name and value.
@@ -321,144 +554,589 @@ private:
     QHtmlParser::MatchFlags m_flags;
 };
 
-class QHtmlElement;
-class QHtmlElementPrivate;
-
 /*!
- * Typedef for QList<QHtmlAttribute>.
+ * Holds the counters collected for a single query, or the totals for all queries made against a document.
+ *
+ * \sa QHtmlParserStats
  */
-typedef QList<QHtmlAttribute> QHtmlAttributes;
+struct QHtmlQueryStats
+{
+    QHtmlQueryStats() :
+        nodesVisited(0),
+        predicatesEvaluated(0),
+        matches(0),
+        elapsed(0)
+    {
+    }
 
-/*!
- * Typedef for QList<QHtmlAttributeMatch>.
- */
-typedef QList<QHtmlAttributeMatch> QHtmlAttributeMatches;
+    /*!
+     * The number of elements examined.
+     */
+    qint64 nodesVisited;
 
-/*!
- * Typedef for QList<QHtmlElement>.
- */
-typedef QList<QHtmlElement> QHtmlElementList;
+    /*!
+     * The number of attribute matches evaluated.
+     */
+    qint64 predicatesEvaluated;
+
+    /*!
+     * The number of elements that satisfied the query.
+     */
+    qint64 matches;
+
+    /*!
+     * The time spent in the query, in nanoseconds.
+     */
+    qint64 elapsed;
+};
 
 /*!
- * Represents a HTML element/tag.
+ * Holds the instrumentation counters collected for a document.
+ *
+ * Statistics are only collected when the library is built with <tt>CONFIG+=qhtmlparser_stats</tt> 
+ * (which defines QHTMLPARSER_STATS). Otherwise all values are zero, except for the parse values, which are 
+ * filled in while a slow document handler is installed. Parsing, queries and renders still make one atomic 
+ * check to see whether any recording, tracing, metrics or slow document handler is active.
+ *
+ * \sa QHtmlDocument::stats()
  */
-class QHTMLPARSER_EXPORT QHtmlElement
+struct QHtmlParserStats
 {
+    QHtmlParserStats() :
+        parseTime(0),
+        bytes(0),
+        nodeCount(0),
+        maxDepth(0),
+        queryCount(0),
+        renderCount(0),
+        renderTime(0)
+    {
+    }
 
-public:
     /*!
-     * Constructs a null QHtmlElement.
+     * The time spent parsing the document, in nanoseconds.
      */
-    QHtmlElement();
-    
+    qint64 parseTime;
+
     /*!
-     * Contructs a copy of \a other.
+     * The size of the document content, in bytes.
      */
-    QHtmlElement(const QHtmlElement &other);
-    
+    qint64 bytes;
+
     /*!
-     * Destroys the QHtmlElement.
+     * The number of nodes (elements, text, comments etc) in the parsed document.
      */
-    ~QHtmlElement();
-    
+    int nodeCount;
+
     /*!
-     * Returns the attributes of the element.
+     * The depth of the most deeply nested node.
      */
-    QHtmlAttributes attributes() const;
-    
+    int maxDepth;
+
     /*!
-     * Returns the value of the attribute with the specified \a name.
-     *
-     * If no attribute is found, an empty string is returned.
+     * The number of queries made against the document.
      */
-    QString attribute(const QString &name) const;
+    int queryCount;
 
     /*!
-     * Returns the element's parent.
+     * The totals for all queries made against the document.
      */
-    QHtmlElement parentElement() const;
+    QHtmlQueryStats queries;
 
     /*!
-     * Returns the next sibling of the element.
-     *
-     * If the element has no next sibling, a null element is returned.
+     * The number of calls to QHtmlElement::text(), QHtmlElement::toString() and QHtmlDocument::toString().
      */
-    QHtmlElement nextSibling() const;
+    int renderCount;
 
     /*!
-     * Returns the previous sibling of the element.
-     *
-     * If the element has no previous sibling, a null element is returned.
+     * The time spent in QHtmlElement::text(), QHtmlElement::toString() and QHtmlDocument::toString(), 
+     * in nanoseconds.
      */
-    QHtmlElement previousSibling() const;
-    
+    qint64 renderTime;
+};
+
+/*!
+ * Holds the counters collected for an individual QHtmlAttributeMatch during a query.
+ *
+ * \sa QHtmlQueryProfile
+ */
+struct QHtmlAttributeMatchProfile
+{
+    QHtmlAttributeMatchProfile() :
+        evaluations(0),
+        successes(0),
+        regExpCompiles(0)
+    {
+    }
+
     /*!
-     * Returns all elements that are a direct child of the element.
+     * The attribute match.
      */
-    QHtmlElementList childElements() const;
-    
+    QHtmlAttributeMatch match;
+
     /*!
-     * Returns the first direct child of the element.
-     *
-     * If the element has no children, a null element is returned.
+     * The number of times the match was evaluated.
      */
-    QHtmlElement firstChildElement() const;
-    
+    qint64 evaluations;
+
     /*!
-     * Returns the last direct child of the element.
-     *
-     * If the element has no children, a null element is returned.
+     * The number of evaluations that were successful.
      */
-    QHtmlElement lastChildElement() const;
-    
+    qint64 successes;
+
     /*!
-     * Returns the \a nth direct child of the element.
-     *
-     * If the element has no children, a null element is returned.
+     * The number of regular expressions that were compiled for QHtmlParser::MatchRegExp 
+     * and QHtmlParser::MatchWildcard matches.
      */
-    QHtmlElement nthChildElement(int n) const;
-    
+    qint64 regExpCompiles;
+};
+
+/*!
+ * Describes how a query was executed and what it cost.
+ *
+ * \sa QHtmlElement::explain()
+ */
+struct QHTMLPARSER_EXPORT QHtmlQueryProfile
+{
+    QHtmlQueryProfile() :
+        strategy(QHtmlParser::FullScan)
+    {
+    }
+
     /*!
-     * Returns the child of the element with 'id' attribute matching \a id.
-     *
-     * If no matching element is found, a null element is returned.
+     * The strategy used to find candidate elements.
      */
-    QHtmlElement elementById(const QString &id) const;
-    
+    QHtmlParser::QueryStrategy strategy;
+
     /*!
-     * Returns all children of the element with tagName() matching \a name.
+     * The counters and elapsed time for the query.
      */
-    QHtmlElementList elementsByTagName(const QString &name) const;
-    
+    QHtmlQueryStats stats;
+
     /*!
-     * \overload
-     *
-     * Returns all children of the element with tagName() matching \a name and attribute matching \a match.
+     * The counters for each attribute match of the query, in the order they were specified.
      */
-    QHtmlElementList elementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
-    
+    QList<QHtmlAttributeMatchProfile> matches;
+
     /*!
-     * \overload
-     *
-     * Returns all children of the element with tagName() matching \a name and attributes matching \a matches.
+     * Returns a human-readable report of the profile.
      */
-    QHtmlElementList elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
-                                       QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
-    
+    QString toString() const;
+};
+
+/*!
+ * Defines the limits above which a slow document handler is called.
+ *
+ * A value of zero disables the corresponding check.
+ *
+ * \sa QHtmlParser::setSlowDocumentHandler()
+ */
+struct QHtmlSlowDocumentLimits
+{
+    QHtmlSlowDocumentLimits() :
+        parseTime(0),
+        queryTime(0),
+        nodeCount(0),
+        maxDepth(0),
+        includeContent(false)
+    {
+    }
+
     /*!
-     * Returns the first child with tagName() matching \a name.
-     *
-     * If no matching element is found, a null element is returned.
+     * The maximum time spent parsing a document, in nanoseconds.
      */
-    QHtmlElement firstElementByTagName(const QString &name) const;
-    
+    qint64 parseTime;
+
     /*!
-     * \overload
-     *
-     * Returns the first child with tagName() matching name and attribute matching match.
+     * The maximum time spent in a single query, in nanoseconds.
      */
-    QHtmlElement firstElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
-    
+    qint64 queryTime;
+
+    /*!
+     * The maximum number of nodes in a parsed document.
+     */
+    int nodeCount;
+
+    /*!
+     * The maximum depth of a parsed document.
+     */
+    int maxDepth;
+
+    /*!
+     * Whether the content of the document is passed to the handler.
+     *
+     * When \c true, the content of documents parsed while the handler is installed is kept 
+     * in memory so that it can be passed to the handler when a query is slow.
+     */
+    bool includeContent;
+};
+
+/*!
+ * Describes a document that exceeded one or more QHtmlSlowDocumentLimits.
+ *
+ * \sa QHtmlParser::setSlowDocumentHandler()
+ */
+struct QHtmlSlowDocumentEvent
+{
+    QHtmlSlowDocumentEvent() :
+        documentId(0)
+    {
+    }
+
+    /*!
+     * The limits that were exceeded.
+     */
+    QHtmlParser::SlowDocumentReasons reasons;
+
+    /*!
+     * The id of the document, as used by recordings and trace events.
+     */
+    int documentId;
+
+    /*!
+     * The name of the query function, if QHtmlParser::SlowQuery is set.
+     */
+    QString function;
+
+    /*!
+     * The statistics of the document.
+     *
+     * The parse time, bytes, node count and depth are always available. The remaining values 
+     * are only collected when the library is built with QHTMLPARSER_STATS.
+     */
+    QHtmlParserStats stats;
+
+    /*!
+     * The statistics of the query, if QHtmlParser::SlowQuery is set.
+     *
+     * Only the elapsed time is available unless the library is built with QHTMLPARSER_STATS or 
+     * QHTMLPARSER_USDT, either of which compiles in the per-query counters.
+     */
+    QHtmlQueryStats query;
+
+    /*!
+     * The content of the document, if QHtmlSlowDocumentLimits::includeContent is set.
+     */
+    QByteArray content;
+};
+
+namespace QHtmlParser
+{
+    /*!
+     * Typedef for a function that is called with a QHtmlSlowDocumentEvent and the user data 
+     * passed to setSlowDocumentHandler().
+     */
+    typedef void (*SlowDocumentHandler)(const QHtmlSlowDocumentEvent &event, void *userData);
+
+    /*!
+     * Sets the function that is called when a document exceeds \a limits to \a handler.
+     *
+     * The handler is called from the thread that parsed or queried the document, and may be called 
+     * concurrently from several threads. Passing a null handler disables the checks.
+     */
+    QHTMLPARSER_EXPORT void setSlowDocumentHandler(SlowDocumentHandler handler, const QHtmlSlowDocumentLimits &limits,
+                                                   void *userData = 0);
+}
+
+/*!
+ * A fingerprint of the visible text of a document, for detecting near-duplicate documents.
+ *
+ * The text is split into lower-case tokens of letters and digits. Text in script and style 
+ * elements is ignored.
+ *
+ * \sa QHtmlDocument::textFingerprint()
+ */
+struct QHTMLPARSER_EXPORT QHtmlTextFingerprint
+{
+    QHtmlTextFingerprint() :
+        simHash(0),
+        tokenCount(0)
+    {
+    }
+
+    /*!
+     * The 64-bit SimHash of the tokens. Documents with similar text have hashes that differ in few bits.
+     */
+    quint64 simHash;
+
+    /*!
+     * The MinHash sketch of the tokens, holding the minimum value of each hash function.
+     *
+     * The sketch is empty unless requested.
+     */
+    QVector<quint64> minHash;
+
+    /*!
+     * The number of tokens in the text.
+     */
+    int tokenCount;
+
+    /*!
+     * Returns the number of bits that differ between the SimHash of this fingerprint and that of \a other.
+     */
+    int distance(const QHtmlTextFingerprint &other) const;
+
+    /*!
+     * Returns the Jaccard similarity of the token sets estimated from the MinHash sketches, between 0 and 1.
+     *
+     * If the sketches are empty or have different sizes, -1 is returned.
+     */
+    double similarity(const QHtmlTextFingerprint &other) const;
+};
+
+/*!
+ * Describes the structure and content of a parsed document.
+ *
+ * Unlike QHtmlParserStats, the statistics are always available, and are computed on request 
+ * in a single traversal of the document.
+ *
+ * \sa QHtmlDocument::statistics()
+ */
+struct QHtmlDocumentStatistics
+{
+    QHtmlDocumentStatistics() :
+        nodeCount(0),
+        elementCount(0),
+        maxDepth(0),
+        meanDepth(0),
+        attributeCount(0),
+        textBytes(0),
+        scriptBytes(0),
+        styleBytes(0)
+    {
+    }
+
+    /*!
+     * The number of nodes below the root of the document, including text and comments.
+     */
+    int nodeCount;
+
+    /*!
+     * The number of elements in the document.
+     */
+    int elementCount;
+
+    /*!
+     * The depth of the most deeply nested node, where the children of the root have a depth of 1.
+     */
+    int maxDepth;
+
+    /*!
+     * The mean depth of the elements in the document.
+     */
+    double meanDepth;
+
+    /*!
+     * The total number of attributes of all elements.
+     */
+    int attributeCount;
+
+    /*!
+     * The number of bytes of text in the document, including scripts and style sheets.
+     */
+    qint64 textBytes;
+
+    /*!
+     * The number of bytes of text inside script elements.
+     */
+    qint64 scriptBytes;
+
+    /*!
+     * The number of bytes of text inside style elements.
+     */
+    qint64 styleBytes;
+
+    /*!
+     * The number of elements with each tag name.
+     */
+    QHash<QString, int> tagCounts;
+
+    /*!
+     * Returns the fraction of textBytes inside script and style elements, between 0 and 1.
+     */
+    double scriptStyleShare() const {
+        return textBytes > 0 ? double(scriptBytes + styleBytes) / textBytes : 0;
+    }
+};
+
+class QHtmlElement;
+class QHtmlElementPrivate;
+
+/*!
+ * Typedef for QList<QHtmlAttribute>.
+ */
+typedef QList<QHtmlAttribute> QHtmlAttributes;
+
+/*!
+ * Typedef for QList<QHtmlAttributeMatch>.
+ */
+typedef QList<QHtmlAttributeMatch> QHtmlAttributeMatches;
+
+/*!
+ * Typedef for QList<QHtmlElement>.
+ */
+typedef QList<QHtmlElement> QHtmlElementList;
+
+struct QHtmlTextMatch;
+
+/*!
+ * Typedef for QList<QHtmlTextMatch>.
+ */
+typedef QList<QHtmlTextMatch> QHtmlTextMatches;
+
+#if QT_VERSION >= 0x050000
+class QRegularExpression;
+#endif
+
+namespace QHtmlParser {
+    /*!
+     * Returns the value of the attribute \a name of each element in \a elements.
+     *
+     * The list has one entry for each element, in the same order. If an element is null or 
+     * does not have the attribute, the entry is an empty string. The attribute name is converted 
+     * once for all elements, so this is cheaper than calling QHtmlElement::attribute() for each element.
+     */
+    QHTMLPARSER_EXPORT QStringList attributeColumn(const QHtmlElementList &elements, const QString &name);
+
+    /*!
+     * Returns the text of each element in \a elements, as returned by QHtmlElement::text().
+     *
+     * The list has one entry for each element, in the same order. A single output buffer is reused 
+     * for all elements.
+     */
+    QHTMLPARSER_EXPORT QStringList textColumn(const QHtmlElementList &elements, bool includeChildElements = false);
+}
+
+/*!
+ * Represents a HTML element/tag.
+ */
+class QHTMLPARSER_EXPORT QHtmlElement
+{
+
+public:
+    /*!
+     * Constructs a null QHtmlElement.
+     */
+    QHtmlElement();
+    
+    /*!
+     * Contructs a copy of \a other.
+     */
+    QHtmlElement(const QHtmlElement &other);
+    
+    /*!
+     * Destroys the QHtmlElement.
+     */
+    ~QHtmlElement();
+    
+    /*!
+     * Returns the attributes of the element.
+     */
+    QHtmlAttributes attributes() const;
+    
+    /*!
+     * Returns the value of the attribute with the specified \a name.
+     *
+     * If no attribute is found, an empty string is returned.
+     */
+    QString attribute(const QString &name) const;
+
+    /*!
+     * Returns the element's parent.
+     */
+    QHtmlElement parentElement() const;
+
+    /*!
+     * Returns the next sibling of the element.
+     *
+     * If the element has no next sibling, a null element is returned.
+     */
+    QHtmlElement nextSibling() const;
+
+    /*!
+     * Returns the previous sibling of the element.
+     *
+     * If the element has no previous sibling, a null element is returned.
+     */
+    QHtmlElement previousSibling() const;
+    
+    /*!
+     * Returns all elements that are a direct child of the element.
+     */
+    QHtmlElementList childElements() const;
+    
+    /*!
+     * Returns the first direct child of the element.
+     *
+     * If the element has no children, a null element is returned.
+     */
+    QHtmlElement firstChildElement() const;
+    
+    /*!
+     * Returns the last direct child of the element.
+     *
+     * If the element has no children, a null element is returned.
+     */
+    QHtmlElement lastChildElement() const;
+    
+    /*!
+     * Returns the \a nth direct child of the element.
+     *
+     * If the element has no children, a null element is returned.
+     */
+    QHtmlElement nthChildElement(int n) const;
+    
+    /*!
+     * Returns the child of the element with 'id' attribute matching \a id.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    QHtmlElement elementById(const QString &id) const;
+    
+    /*!
+     * Returns all children of the element with tagName() matching \a name.
+     */
+    QHtmlElementList elementsByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns all children of the element with tagName() matching \a name and attribute matching \a match.
+     */
+    QHtmlElementList elementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns all children of the element with tagName() matching \a name and attributes matching \a matches.
+     */
+    QHtmlElementList elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                       QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns all children of the element that have the attribute \a name, whatever its value.
+     *
+     * If the attribute index of the document is enabled, the elements are found without visiting 
+     * the other children.
+     *
+     * \sa QHtmlDocument::setAttributeIndexEnabled()
+     */
+    QHtmlElementList elementsWithAttribute(const QString &name) const;
+    
+    /*!
+     * Returns the first child with tagName() matching \a name.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    QHtmlElement firstElementByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the first child with tagName() matching name and attribute matching match.
+     */
+    QHtmlElement firstElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
     /*!
      * \overload
      *
@@ -511,6 +1189,265 @@ public:
     QHtmlElement nthElementByTagName(int n, const QString &name, const QHtmlAttributeMatches &matches,
                                      QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;    
     
+    /*!
+     * \overload
+     *
+     * Returns all children of the element with tagName() matching \a name, up to \a maxDepth levels below 
+     * the element.
+     *
+     * Children below \a maxDepth are not visited. A \a maxDepth of 1 searches only the direct children.
+     */
+    QHtmlElementList elementsByTagName(const QString &name, int maxDepth) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns all children of the element with tagName() matching \a name and attributes matching \a matches, 
+     * up to \a maxDepth levels below the element.
+     */
+    QHtmlElementList elementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                       QHtmlParser::MatchType matchType, int maxDepth) const;
+    
+    /*!
+     * Returns the direct children of the element with tagName() matching \a name.
+     *
+     * Unlike elementsByTagName(), deeper descendants are not visited.
+     */
+    QHtmlElementList childElementsByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the direct children of the element with tagName() matching \a name and attribute matching \a match.
+     */
+    QHtmlElementList childElementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the direct children of the element with tagName() matching \a name and attributes matching 
+     * \a matches.
+     */
+    QHtmlElementList childElementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                            QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns the first following sibling of the element with tagName() matching \a name.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    QHtmlElement nextSiblingByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the first following sibling of the element with tagName() matching \a name and attribute 
+     * matching \a match.
+     */
+    QHtmlElement nextSiblingByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the first following sibling of the element with tagName() matching \a name and attributes 
+     * matching \a matches.
+     */
+    QHtmlElement nextSiblingByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                      QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns the nearest preceding sibling of the element with tagName() matching \a name.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    QHtmlElement previousSiblingByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the nearest preceding sibling of the element with tagName() matching \a name and attribute 
+     * matching \a match.
+     */
+    QHtmlElement previousSiblingByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the nearest preceding sibling of the element with tagName() matching \a name and attributes 
+     * matching \a matches.
+     */
+    QHtmlElement previousSiblingByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                                          QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns the nearest element with tagName() matching \a name, starting with the element itself 
+     * and continuing with its ancestors.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    QHtmlElement closest(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the nearest element with tagName() matching \a name and attribute matching \a match, 
+     * starting with the element itself.
+     */
+    QHtmlElement closest(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the nearest element with tagName() matching \a name and attributes matching \a matches, 
+     * starting with the element itself.
+     */
+    QHtmlElement closest(const QString &name, const QHtmlAttributeMatches &matches,
+                         QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns the number of children with tagName() matching \a name.
+     *
+     * Unlike elementsByTagName(), no elements are created.
+     */
+    int countElementsByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the number of children with tagName() matching \a name and attribute matching \a match.
+     */
+    int countElementsByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns the number of children with tagName() matching \a name and attributes matching \a matches.
+     */
+    int countElementsByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                               QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns \c true if any child has tagName() matching \a name.
+     *
+     * The search stops at the first matching element, and no elements are created.
+     */
+    bool hasElementByTagName(const QString &name) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns \c true if any child has tagName() matching \a name and attribute matching \a match.
+     */
+    bool hasElementByTagName(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     *
+     * Returns \c true if any child has tagName() matching \a name and attributes matching \a matches.
+     */
+    bool hasElementByTagName(const QString &name, const QHtmlAttributeMatches &matches,
+                             QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Calls \a visitor for each child of the element in document order, and returns the visitor.
+     *
+     * \a visitor may be a function or function object taking a const QHtmlElement reference and 
+     * returning QHtmlParser::VisitResult. A single element is created when the traversal starts and is 
+     * moved from node to node, so the traversal itself allocates once rather than once per visited 
+     * element. Copy the element to keep it beyond the call; like any copy of a QHtmlElement, this 
+     * allocates.
+     *
+     * Only \a visitor is inlined into the caller. Each step of the traversal is an out-of-line call into 
+     * the library, since the parsed tree is not visible from this header, so the saving over 
+     * elementsByTagName() comes from not building a list, not from an inlined loop.
+     *
+     * Example usage:
+     *
+     * \code
+     * struct LinkCounter
+     * {
+     *     LinkCounter() : count(0) {}
+     *
+     *     QHtmlParser::VisitResult operator()(const QHtmlElement &element) {
+     *         if (element.tagName() == "script") {
+     *             return QHtmlParser::SkipChildren;
+     *         }
+     *
+     *         if (element.tagName() == "a") {
+     *             ++count;
+     *         }
+     *
+     *         return QHtmlParser::ContinueVisit;
+     *     }
+     *
+     *     int count;
+     * };
+     * ...
+     * const int links = document.bodyElement().visit(LinkCounter()).count;
+     * \endcode
+     */
+    template <typename Visitor>
+    Visitor visit(Visitor visitor) const {
+        QHtmlElement element;
+        bool descend = true;
+        
+        while (nextDescendant(element, descend)) {
+            const QHtmlParser::VisitResult result = visitor(static_cast<const QHtmlElement&>(element));
+            
+            if (result == QHtmlParser::StopVisit) {
+                break;
+            }
+            
+            descend = (result != QHtmlParser::SkipChildren);
+        }
+        
+        return visitor;
+    }
+    
+    /*!
+     * Returns the first child of the element, in document order, for which \a predicate returns \c true.
+     *
+     * \a predicate may be a function or function object taking a const QHtmlElement reference and 
+     * returning bool. As with visit(), a single element is reused for the nodes tested, and each step 
+     * of the traversal is an out-of-line call into the library.
+     *
+     * If no matching element is found, a null element is returned.
+     */
+    template <typename Predicate>
+    QHtmlElement findFirst(Predicate predicate) const {
+        QHtmlElement element;
+        
+        while (nextDescendant(element, true)) {
+            if (predicate(static_cast<const QHtmlElement&>(element))) {
+                return element;
+            }
+        }
+        
+        return element;
+    }
+    
+    /*!
+     * Returns all children of the element, in document order, for which \a predicate returns \c true.
+     *
+     * As with visit(), a single element is reused for the nodes tested, but each match is copied 
+     * into the returned list.
+     *
+     * \sa findFirst()
+     */
+    template <typename Predicate>
+    QHtmlElementList findAll(Predicate predicate) const {
+        QHtmlElementList elements;
+        QHtmlElement element;
+        
+        while (nextDescendant(element, true)) {
+            if (predicate(static_cast<const QHtmlElement&>(element))) {
+                elements << element;
+            }
+        }
+        
+        return elements;
+    }
+    
     /*!
      * Returns the tag name of the element.
      *
@@ -519,46 +1456,279 @@ public:
     QString tagName() const;
     
     /*!
-     * Returns any text for the element, including any child elements if \a includeChildElements is \c true.
-     *
-     * If the element is null, an empty string is returned.
+     * Returns any text for the element, including any child elements if \a includeChildElements is \c true.
+     *
+     * If the element is null, an empty string is returned.
+     */
+    QString text(bool includeChildElements = false) const;
+    
+    /*!
+     * \overload
+     *
+     * Appends any text for the element to \a out, including any child elements if \a includeChildElements 
+     * is \c true.
+     *
+     * Reusing \a out for several elements avoids allocating a new string for each one.
+     */
+    void text(QString &out, bool includeChildElements = false) const;
+    
+    /*!
+     * Returns the HTML string of the element.
+     *
+     * If the element is null, an empty string is returned.
+     */
+    QString toString() const;
+    
+    /*!
+     * Returns a 64-bit hash of the element and its descendants.
+     *
+     * The hash is computed over the tag name and attributes of the element, and the hashes of its 
+     * child nodes in order, including text and comments, so elements with identical content have 
+     * the same hash and a change anywhere in a subtree changes the hash of each of its ancestors. 
+     * The hash of the document element can be used to identify the whole document.
+     *
+     * Hashes are computed the first time they are requested for a subtree and stored with the 
+     * document until its content is set again.
+     *
+     * If the element is null, 0 is returned.
+     */
+    quint64 contentHash() const;
+    
+#if QT_VERSION >= 0x050000
+    /*!
+     * Returns the matches of \a regExp in the text below the element, in document order.
+     *
+     * The text nodes are streamed through \a regExp one run at a time, where a run is a sequence of 
+     * text nodes separated only by inline elements such as 'a', 'b' or 'span', so a match can span 
+     * adjacent text nodes, e.g. a price split by a 'span' element. The text of other elements starts 
+     * a new run, and the text of script and style elements is ignored. Empty matches are skipped.
+     *
+     * Each match reports the innermost element that encloses all of the matched text, and the offset 
+     * of the match within that element's source text: the decoded values of the text nodes below the 
+     * element, in document order and without separators, excluding the text of script and style 
+     * elements. Offsets are counted in QChar units. This is not the string returned by 
+     * QHtmlElement::text(true), which is rendered by the printer with entities escaped and a line 
+     * break after each text node, and which includes script and style text, so offsets cannot be 
+     * used to index that string.
+     *
+     * Example usage:
+     *
+     * \code
+     * const QRegularExpression price("\\$\\s*\\d+(\\.\\d\\d)?");
+     *
+     * foreach (const QHtmlTextMatch &match, body.findText(price)) {
+     *     qDebug() << match.element.tagName() << match.offset << match.capturedTexts.first();
+     * }
+     * \endcode
+     *
+     * The offset skips the text of script elements:
+     *
+     * \code
+     * const QHtmlDocument document("<p>Code:<script>x()</script>A12</p>");
+     * const QHtmlTextMatches matches = document.bodyElement().findText(QRegularExpression("A\\d+"));
+     *
+     * Q_ASSERT(matches.size() == 1);
+     * Q_ASSERT(matches.first().element.tagName() == "p");
+     * Q_ASSERT(matches.first().offset == 5); // The length of "Code:".
+     * Q_ASSERT(matches.first().length == 3);
+     * \endcode
+     */
+    QHtmlTextMatches findText(const QRegularExpression &regExp) const;
+#endif
+    
+    /*!
+     * Runs the same search as elementsByTagName() with \a name and reports how it was executed.
+     *
+     * The elements found are discarded. Unlike QHtmlDocument::stats(), the profile is always 
+     * collected, regardless of how the library was built.
+     *
+     * \sa QHtmlQueryProfile
+     */
+    QHtmlQueryProfile explain(const QString &name) const;
+    
+    /*!
+     * \overload
+     */
+    QHtmlQueryProfile explain(const QString &name, const QHtmlAttributeMatch &match) const;
+    
+    /*!
+     * \overload
+     */
+    QHtmlQueryProfile explain(const QString &name, const QHtmlAttributeMatches &matches,
+                              QHtmlParser::MatchType matchType = QHtmlParser::MatchAll) const;
+    
+    /*!
+     * Returns \c true if the element is null.
+     *
+     * An element is null if it does not represent a tag in a HTML document.
+     */
+    bool isNull() const;
+
+    QHtmlElement& operator=(const QHtmlElement &other);
+    
+    /*!
+     * Returns \c true if \a other represents the same tag in the same document as this QHtmlElement.
+     */
+    bool operator==(const QHtmlElement &other) const;
+    
+    /*!
+     * Returns \c true if \a other does not represent the same tag in the same document as this QHtmlElement.
+     */
+    bool operator!=(const QHtmlElement &other) const;
+
+private:
+    bool nextDescendant(QHtmlElement &element, bool descend) const;
+    
+    QHtmlElementPrivate *d;
+    
+    friend class QHtmlDocument;
+    friend class QHtmlDiffBuilder;
+    friend class QHtmlElementSet;
+    friend class QHtmlElementSetPrivate;
+    friend QStringList QHtmlParser::attributeColumn(const QHtmlElementList &elements, const QString &name);
+    friend QStringList QHtmlParser::textColumn(const QHtmlElementList &elements, bool includeChildElements);
+};
+
+class QHtmlElementSetPrivate;
+
+/*!
+ * A set of elements of one document, kept in document order.
+ *
+ * The QHtmlElementSet class stores the position of each element in a pre-order traversal of its 
+ * document, in a sorted array. Union, intersection and difference are computed by merging the 
+ * arrays in linear time, and contains() uses a binary search. The positions are indexed once per 
+ * document, the first time a set of its elements is created.
+ *
+ * All elements of a set belong to the same document. Null elements, and elements of a different 
+ * document than the set, are ignored.
+ *
+ * The positions are only meaningful for the parse of the document they were taken from. Once the 
+ * content of the document is set again, the set behaves as an empty set: size() returns 0, at() 
+ * returns a null element, and the set operations treat it as empty. Like QHtmlElement, a set must 
+ * not be used after its document has been destroyed.
+ *
+ * Example usage:
+ *
+ * \code
+ * QHtmlElementSet links(body.elementsByTagName("a"));
+ * links -= QHtmlElementSet(body.elementsByTagName("a", QHtmlAttributeMatch("class", "ad")));
+ * links = links.within(body.elementById("content"));
+ * \endcode
+ *
+ * The results of the operations on a small document:
+ *
+ * \code
+ * const QHtmlDocument document("<div><p>1</p><p>2</p></div><p>3</p>");
+ * const QHtmlElement body = document.bodyElement();
+ * const QHtmlElement div = body.firstElementByTagName("div");
+ * const QHtmlElementSet all(body.elementsByTagName("p"));     // 1, 2, 3
+ * const QHtmlElementSet inDiv(div.elementsByTagName("p"));    // 1, 2
+ * const QHtmlElementSet outside = all - inDiv;                // 3
+ *
+ * Q_ASSERT((all & inDiv) == inDiv);
+ * Q_ASSERT((inDiv | outside) == all);
+ * Q_ASSERT(all.within(div) == inDiv);
+ * Q_ASSERT(outside.at(0).text() == "3");
+ * \endcode
+ */
+class QHTMLPARSER_EXPORT QHtmlElementSet
+{
+
+public:
+    /*!
+     * Constructs an empty QHtmlElementSet.
+     */
+    QHtmlElementSet();
+    
+    /*!
+     * Constructs a QHtmlElementSet containing \a elements.
+     *
+     * Duplicate elements are removed.
+     */
+    explicit QHtmlElementSet(const QHtmlElementList &elements);
+    
+    QHtmlElementSet(const QHtmlElementSet &other);
+    
+    ~QHtmlElementSet();
+    
+    /*!
+     * Returns the number of elements in the set.
+     */
+    int size() const;
+    
+    /*!
+     * Returns \c true if the set contains no elements.
+     */
+    bool isEmpty() const;
+    
+    /*!
+     * Returns \c true if the set contains \a element.
+     */
+    bool contains(const QHtmlElement &element) const;
+    
+    /*!
+     * Inserts \a element into the set.
+     */
+    void insert(const QHtmlElement &element);
+    
+    /*!
+     * Returns the element at position \a i of the set, in document order.
+     */
+    QHtmlElement at(int i) const;
+    
+    /*!
+     * Returns the elements of the set in document order.
+     */
+    QHtmlElementList toList() const;
+    
+    /*!
+     * Returns the elements of the set that are descendants of \a ancestor.
+     *
+     * The descendants of an element occupy a contiguous range of the document order, so the 
+     * range is found using a binary search.
+     */
+    QHtmlElementSet within(const QHtmlElement &ancestor) const;
+    
+    /*!
+     * Inserts the elements of \a other into the set, and returns a reference to the set.
      */
-    QString text(bool includeChildElements = false) const;
+    QHtmlElementSet& unite(const QHtmlElementSet &other);
     
     /*!
-     * Returns the HTML string of the element.
-     *
-     * If the element is null, an empty string is returned.
+     * Removes the elements that are not in \a other from the set, and returns a reference to the set.
      */
-    QString toString() const;
+    QHtmlElementSet& intersect(const QHtmlElementSet &other);
     
     /*!
-     * Returns \c true if the element is null.
-     *
-     * An element is null if it does not represent a tag in a HTML document.
+     * Removes the elements that are in \a other from the set, and returns a reference to the set.
      */
-    bool isNull() const;
-
-    QHtmlElement& operator=(const QHtmlElement &other);
+    QHtmlElementSet& subtract(const QHtmlElementSet &other);
+    
+    QHtmlElementSet& operator=(const QHtmlElementSet &other);
+    
+    QHtmlElementSet& operator|=(const QHtmlElementSet &other) { return unite(other); }
+    QHtmlElementSet& operator&=(const QHtmlElementSet &other) { return intersect(other); }
+    QHtmlElementSet& operator-=(const QHtmlElementSet &other) { return subtract(other); }
+    
+    QHtmlElementSet operator|(const QHtmlElementSet &other) const { QHtmlElementSet result(*this); return result.unite(other); }
+    QHtmlElementSet operator&(const QHtmlElementSet &other) const { QHtmlElementSet result(*this); return result.intersect(other); }
+    QHtmlElementSet operator-(const QHtmlElementSet &other) const { QHtmlElementSet result(*this); return result.subtract(other); }
     
     /*!
-     * Returns \c true if \a other represents the same tag in the same document as this QHtmlElement.
+     * Returns \c true if \a other contains the same elements as this set.
      */
-    bool operator==(const QHtmlElement &other) const;
+    bool operator==(const QHtmlElementSet &other) const;
     
     /*!
-     * Returns \c true if \a other does not represent the same tag in the same document as this QHtmlElement.
+     * Returns \c true if \a other does not contain the same elements as this set.
      */
-    bool operator!=(const QHtmlElement &other) const;
+    bool operator!=(const QHtmlElementSet &other) const;
 
 private:
-    QHtmlElementPrivate *d;
-    
-    friend class QHtmlDocument;
+    QHtmlElementSetPrivate *d;
 };
 
 class QHtmlDocumentPrivate;
-class QIODevice;
 
 /*!
  * Represents a HTML document.
@@ -695,6 +1865,196 @@ public:
      */
     QString errorString() const;
     
+    /*!
+     * Returns the instrumentation counters collected for the document since its content was last set.
+     *
+     * \sa QHtmlParserStats
+     */
+    QHtmlParserStats stats() const;
+    
+    /*!
+     * Returns a fingerprint of the visible text of the document.
+     *
+     * The SimHash and, if \a minHashCount is greater than zero, a MinHash sketch of \a minHashCount values 
+     * are computed while the text nodes of the body are read, without building the text of the document.
+     *
+     * If the document is null, an empty fingerprint is returned.
+     */
+    QHtmlTextFingerprint textFingerprint(int minHashCount = 0) const;
+    
+    /*!
+     * Returns statistics describing the structure and content of the document.
+     *
+     * If the document is null, empty statistics are returned.
+     */
+    QHtmlDocumentStatistics statistics() const;
+    
+    /*!
+     * Returns \c true if query results are memoised.
+     *
+     * The default is \c false.
+     *
+     * \sa setQueryCacheEnabled()
+     */
+    bool isQueryCacheEnabled() const;
+    
+    /*!
+     * Sets whether query results should be memoised to \a enabled.
+     *
+     * When enabled, the results of QHtmlElement::elementById() and QHtmlElement::elementsByTagName() 
+     * are stored per document, keyed by the element queried and the query, so that repeating an identical 
+     * query returns the stored result without traversing the document. The order of attribute matches 
+     * does not affect the key. At most 1024 results are stored per document; once full, the least 
+     * recently used result is discarded. Stored results are discarded when the content of the document 
+     * is set, or when caching is disabled.
+     *
+     * Queries answered from the cache are still counted in stats(), metrics and traces, with no 
+     * elements visited.
+     */
+    void setQueryCacheEnabled(bool enabled);
+    
+    /*!
+     * Returns \c true if the attribute index is enabled.
+     *
+     * The default is \c false.
+     *
+     * \sa setAttributeIndexEnabled()
+     */
+    bool isAttributeIndexEnabled() const;
+    
+    /*!
+     * Sets whether the document should index its elements by attribute name to \a enabled.
+     *
+     * When enabled, the index is built in a single traversal the first time it is needed, and used by 
+     * QHtmlElement::elementsWithAttribute() and by QHtmlElement::elementsByTagName() with attribute matches 
+     * and QHtmlParser::MatchAll, including the first, last, nth, count and has variants, which then only 
+     * examine the elements that have the least common of the matched attributes. QHtmlElement::explain() 
+     * reports when the index is used. The index is discarded when the content of the document is set, 
+     * or when the index is disabled.
+     *
+     * The index may be enabled or disabled while other threads query the document. A query that is 
+     * already running completes using the candidates it found when it started.
+     *
+     * Example usage:
+     *
+     * \code
+     * QHtmlDocument document("<div><a href=\"/a\">A</a><a>B</a><p title=\"x\">C</p></div>");
+     * document.setAttributeIndexEnabled(true);
+     * const QHtmlElement body = document.bodyElement();
+     * const QHtmlQueryProfile profile = body.explain("a", QHtmlAttributeMatch("href", "/a"));
+     *
+     * Q_ASSERT(body.elementsWithAttribute("href").size() == 1);
+     * Q_ASSERT(profile.strategy == QHtmlParser::AttributeIndex);
+     * Q_ASSERT(profile.stats.nodesVisited == 1); // Only the element with an href attribute is examined.
+     * \endcode
+     */
+    void setAttributeIndexEnabled(bool enabled);
+    
+    /*!
+     * Returns the names of the attributes whose values are indexed.
+     *
+     * \sa setValueIndexedAttributes()
+     */
+    QStringList valueIndexedAttributes() const;
+    
+    /*!
+     * Sets the names of the attributes whose values should be indexed to \a names.
+     *
+     * For each attribute, the index holds the case-folded values and the elements they belong to, 
+     * sorted by value. The indexes are built in a single traversal the first time they are needed. 
+     * QHtmlElement::elementsByTagName() and its first, last, nth, count and has variants, with 
+     * QHtmlParser::MatchAll or a single attribute match, then look up a QHtmlParser::MatchExactly or 
+     * QHtmlParser::MatchStartsWith match of an indexed attribute using a binary search, and only examine 
+     * the elements found. The indexes are discarded when the content of the document is set, or when 
+     * the attributes are changed.
+     *
+     * The attributes may be changed while other threads query the document. A query that is already 
+     * running completes using the candidates it found when it started.
+     *
+     * Example usage:
+     *
+     * \code
+     * document.setValueIndexedAttributes(QStringList() << "href");
+     * ...
+     * foreach (const QString &prefix, prefixes) {
+     *     links << body.elementsByTagName("a", QHtmlAttributeMatch("href", prefix, QHtmlParser::MatchStartsWith));
+     * }
+     * \endcode
+     *
+     * Only the elements found in the index are examined:
+     *
+     * \code
+     * QHtmlDocument document("<a href=\"/docs/a\">A</a><a href=\"/docs/b\">B</a><a href=\"/blog\">C</a>");
+     * document.setValueIndexedAttributes(QStringList() << "href");
+     * const QHtmlElement body = document.bodyElement();
+     * const QHtmlAttributeMatch docs("href", "/docs/", QHtmlParser::MatchStartsWith);
+     * const QHtmlQueryProfile profile = body.explain("a", docs);
+     *
+     * Q_ASSERT(body.elementsByTagName("a", docs).size() == 2);
+     * Q_ASSERT(profile.strategy == QHtmlParser::ValueIndex);
+     * Q_ASSERT(profile.stats.nodesVisited == 2);
+     * \endcode
+     */
+    void setValueIndexedAttributes(const QStringList &names);
+    
+    /*!
+     * Returns \c true if the full-text index is enabled.
+     *
+     * The default is \c false.
+     *
+     * \sa setTextIndexEnabled()
+     */
+    bool isTextIndexEnabled() const;
+    
+    /*!
+     * Sets whether the document should index the words of its text to \a enabled.
+     *
+     * When enabled, the index maps each word to its positions in the text and the text nodes that 
+     * contain them. It is built in a single traversal the first time elementsContainingText() is called, 
+     * and discarded when the content of the document is set, or when the index is disabled.
+     */
+    void setTextIndexEnabled(bool enabled);
+    
+    /*!
+     * Returns the elements whose text contains the words of \a text, in document order.
+     *
+     * The text is split into words, ignoring case, punctuation and whitespace, in the same way as for 
+     * textFingerprint(). If it contains more than one word, the words must occur consecutively, 
+     * as a phrase. Only inline elements, such as a, b, em or span, may separate the words of a phrase; 
+     * the start or end of any other element, such as p, div, li or td, breaks it, so "foo bar" does not 
+     * match <p>foo</p><p>bar</p>. Each occurrence is mapped to the innermost element that encloses all 
+     * of its words, so a phrase that spans inline elements is reported against their common ancestor. 
+     * The text of script and style elements is ignored.
+     *
+     * If the full-text index is enabled, the occurrences are found from the index, otherwise the 
+     * text of the document is scanned.
+     *
+     * Example usage:
+     *
+     * \code
+     * document.setTextIndexEnabled(true);
+     *
+     * foreach (const QString &term, terms) {
+     *     foreach (const QHtmlElement &element, document.elementsContainingText(term)) {
+     *         report(term, element.tagName());
+     *     }
+     * }
+     * \endcode
+     *
+     * A phrase may span inline elements but not paragraphs:
+     *
+     * \code
+     * QHtmlDocument document("<p>foo</p><p>bar</p><p>Foo <b>bar</b></p>");
+     * const QHtmlElementList found = document.elementsContainingText("foo bar");
+     *
+     * Q_ASSERT(found.size() == 1);
+     * Q_ASSERT(found.first() == document.bodyElement().lastElementByTagName("p"));
+     * \endcode
+     *
+     * \sa setTextIndexEnabled()
+     */
+    QHtmlElementList elementsContainingText(const QString &text) const;
+    
     /*!
      * Returns \c true if the document is null.
      *
@@ -705,6 +2065,319 @@ public:
 private:
     QHtmlDocumentPrivate *d;
     Q_DISABLE_COPY(QHtmlDocument)
+    
+    friend class QHtmlDocumentCache;
+};
+
+/*!
+ * Defines the query options applied to each document parsed by a QHtmlDocumentCache.
+ *
+ * \sa QHtmlDocumentCache::setDocumentOptions()
+ */
+struct QHtmlDocumentOptions
+{
+    QHtmlDocumentOptions() :
+        queryCacheEnabled(false),
+        attributeIndexEnabled(false),
+        textIndexEnabled(false)
+    {
+    }
+
+    /*!
+     * Whether query results are memoised.
+     *
+     * \sa QHtmlDocument::setQueryCacheEnabled()
+     */
+    bool queryCacheEnabled;
+
+    /*!
+     * Whether elements are indexed by attribute name.
+     *
+     * \sa QHtmlDocument::setAttributeIndexEnabled()
+     */
+    bool attributeIndexEnabled;
+
+    /*!
+     * The names of the attributes whose values are indexed.
+     *
+     * \sa QHtmlDocument::setValueIndexedAttributes()
+     */
+    QStringList valueIndexedAttributes;
+
+    /*!
+     * Whether the words of the text are indexed.
+     *
+     * \sa QHtmlDocument::setTextIndexEnabled()
+     */
+    bool textIndexEnabled;
+};
+
+class QHtmlDocumentCachePrivate;
+
+/*!
+ * Caches parsed documents by the content they were parsed from.
+ *
+ * The QHtmlDocumentCache class avoids parsing byte-identical content more than once. Documents are 
+ * keyed by the SHA-256 digest of their content (SHA-1 with Qt 4, against which colliding content can 
+ * be crafted), and the least recently used documents are evicted once the estimated memory used by the 
+ * cached documents exceeds maxCost().
+ *
+ * Documents are returned as shared, read-only instances. They remain valid while referenced, even after 
+ * being evicted from the cache, and may be queried from several threads at once. Since they cannot be 
+ * changed, the query cache and indexes of the documents are chosen for the whole cache using 
+ * setDocumentOptions().
+ *
+ * Example usage:
+ *
+ * \code
+ * QHtmlDocumentCache cache(32 * 1024 * 1024);
+ * ...
+ * const QSharedPointer<const QHtmlDocument> document = cache.document(reply->readAll());
+ * const QHtmlElementList links = document->bodyElement().elementsByTagName("a");
+ * \endcode
+ */
+class QHTMLPARSER_EXPORT QHtmlDocumentCache
+{
+
+public:
+    /*!
+     * Constructs a QHtmlDocumentCache that holds documents up to an estimated total of \a maxCost bytes.
+     */
+    explicit QHtmlDocumentCache(qint64 maxCost = 64 * 1024 * 1024);
+    
+    /*!
+     * Destroys the QHtmlDocumentCache.
+     *
+     * Documents that are still referenced elsewhere remain valid.
+     */
+    ~QHtmlDocumentCache();
+    
+    /*!
+     * Returns the document parsed from \a content.
+     *
+     * If a document with the same content is cached, it is returned without parsing. Otherwise, 
+     * \a content is parsed and the document is added to the cache.
+     *
+     * Example usage:
+     *
+     * \code
+     * QHtmlDocumentCache cache;
+     * const QByteArray content("<p>Hello</p>");
+     * const QSharedPointer<const QHtmlDocument> first = cache.document(content);  // Miss: parsed and added.
+     * const QSharedPointer<const QHtmlDocument> second = cache.document(content); // Hit: same instance.
+     * const QSharedPointer<const QHtmlDocument> third = cache.document("<p>Hello!</p>"); // Miss.
+     *
+     * Q_ASSERT(first == second);
+     * Q_ASSERT(third != first);
+     * Q_ASSERT(cache.count() == 2);
+     * \endcode
+     */
+    QSharedPointer<const QHtmlDocument> document(const QByteArray &content);
+    
+    /*!
+     * Returns the options applied to each document parsed by the cache.
+     *
+     * \sa setDocumentOptions()
+     */
+    QHtmlDocumentOptions documentOptions() const;
+    
+    /*!
+     * Sets the options applied to each document parsed by the cache to \a options.
+     *
+     * The options are applied to a document after it is parsed and before it is returned. Documents 
+     * that are already cached keep the options they were parsed with.
+     *
+     * Example usage:
+     *
+     * \code
+     * QHtmlDocumentOptions options;
+     * options.attributeIndexEnabled = true;
+     * options.valueIndexedAttributes << "href";
+     * cache.setDocumentOptions(options);
+     * \endcode
+     */
+    void setDocumentOptions(const QHtmlDocumentOptions &options);
+    
+    /*!
+     * Returns the maximum estimated memory used by the cached documents, in bytes.
+     */
+    qint64 maxCost() const;
+    
+    /*!
+     * Sets the maximum estimated memory used by the cached documents to \a maxCost bytes.
+     *
+     * Documents are evicted if necessary.
+     */
+    void setMaxCost(qint64 maxCost);
+    
+    /*!
+     * Returns the estimated memory used by the cached documents, in bytes.
+     */
+    qint64 totalCost() const;
+    
+    /*!
+     * Returns the number of cached documents.
+     */
+    int count() const;
+    
+    /*!
+     * Removes all documents from the cache.
+     */
+    void clear();
+
+private:
+    QHtmlDocumentCachePrivate *d;
+    Q_DISABLE_COPY(QHtmlDocumentCache)
+};
+
+/*!
+ * Describes a match of a regular expression in the text of a document.
+ *
+ * \sa QHtmlElement::findText()
+ */
+struct QHtmlTextMatch
+{
+    QHtmlTextMatch() :
+        offset(-1),
+        length(0)
+    {
+    }
+
+    /*!
+     * The innermost element that encloses all of the matched text.
+     */
+    QHtmlElement element;
+
+    /*!
+     * The offset of the match, in QChar units, within the concatenated values of the text nodes below 
+     * element, excluding script and style text.
+     *
+     * \sa QHtmlElement::findText()
+     */
+    int offset;
+
+    /*!
+     * The length of the match, in characters.
+     */
+    int length;
+
+    /*!
+     * The matched text, followed by the text captured by each group.
+     */
+    QStringList capturedTexts;
+};
+
+/*!
+ * Describes an element that is present in both documents compared by QHtmlDiff, but whose 
+ * attributes or text differ.
+ */
+struct QHtmlElementChange
+{
+    QHtmlElementChange() :
+        textChanged(false)
+    {
+    }
+
+    /*!
+     * The element in the old document.
+     */
+    QHtmlElement oldElement;
+
+    /*!
+     * The element in the new document.
+     */
+    QHtmlElement newElement;
+
+    /*!
+     * The attributes present only in the new element.
+     */
+    QHtmlAttributes insertedAttributes;
+
+    /*!
+     * The attributes present only in the old element.
+     */
+    QHtmlAttributes removedAttributes;
+
+    /*!
+     * The attributes present in both elements with different values, holding the new values.
+     */
+    QHtmlAttributes changedAttributes;
+
+    /*!
+     * Whether the text or comments directly inside the element differ.
+     */
+    bool textChanged;
+};
+
+/*!
+ * A list of QHtmlElementChange.
+ */
+typedef QList<QHtmlElementChange> QHtmlElementChanges;
+
+/*!
+ * Describes the differences between two parsed documents.
+ *
+ * Subtrees are compared using QHtmlElement::contentHash(), so identical subtrees are skipped without 
+ * being traversed, and the cost of a diff grows with the number of changed elements rather than the 
+ * size of the documents.
+ *
+ * Child elements are paired with identical elements first, then with remaining elements that have the 
+ * same tag name and id. Elements that cannot be paired are reported as inserted or removed, along with 
+ * their descendants.
+ *
+ * Example usage:
+ *
+ * \code
+ * const QHtmlDiff diff = QHtmlDiff::compute(oldDocument, newDocument);
+ *
+ * foreach (const QHtmlElement &element, diff.insertedElements) {
+ *     qDebug() << "Inserted:" << element.toString();
+ * }
+ * \endcode
+ *
+ * For example, comparing these documents:
+ *
+ * \code
+ * const QHtmlDocument oldDocument("<ul><li>One</li><li>Two</li></ul>");
+ * const QHtmlDocument newDocument("<ul><li>One</li><li>2</li><li>Three</li></ul>");
+ * const QHtmlDiff diff = QHtmlDiff::compute(oldDocument, newDocument);
+ * \endcode
+ *
+ * skips the identical first item, pairs the second items by tag name and reports one change with 
+ * textChanged set, from "Two" to "2", and the third item as inserted. Nothing is removed.
+ */
+struct QHTMLPARSER_EXPORT QHtmlDiff
+{
+    /*!
+     * Returns the differences between \a oldDocument and \a newDocument.
+     *
+     * The elements reported refer to the documents, and become invalid when either is destroyed.
+     */
+    static QHtmlDiff compute(const QHtmlDocument &oldDocument, const QHtmlDocument &newDocument);
+
+    /*!
+     * Returns \c true if the documents are identical.
+     */
+    bool isEmpty() const;
+
+    /*!
+     * The elements of the new document that are not in the old document.
+     *
+     * Only the top-most element of an inserted subtree is reported.
+     */
+    QHtmlElementList insertedElements;
+
+    /*!
+     * The elements of the old document that are not in the new document.
+     *
+     * Only the top-most element of a removed subtree is reported.
+     */
+    QHtmlElementList removedElements;
+
+    /*!
+     * The elements present in both documents with different attributes or text.
+     */
+    QHtmlElementChanges changedElements;
 };
 
 #endif // QHTMLPARSER_H
@@ -5,6 +5,14 @@ QT -= gui
 
 DEFINES += QHTMLPARSER_LIBRARY
 
+qhtmlparser_stats {
+    DEFINES += QHTMLPARSER_STATS
+}
+
+qhtmlparser_usdt {
+    DEFINES += QHTMLPARSER_USDT
+}
+
 DESTDIR = .
 
 HEADERS += \
@@ -0,0 +1,372 @@
+/*!
+ * Copyright (C) 2016 Stuart Howarth <showarth@marxoft.co.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * qhtmlreplay re-executes a recording made using QHtmlParser::startRecording(),
+ * and reports the time spent parsing documents and running each type of query.
+ *
+ * Usage: qhtmlreplay [-c <corpus directory>] [-n <iterations>] <recording>
+ *
+ * Documents recorded without their content are loaded from the recorded path if
+ * it still matches the recorded hash, otherwise from '<corpus directory>/<sha1>'.
+ */
+
+#include <qhtmlparser.h>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#if QT_VERSION >= 0x050000
+#include <QRegularExpression>
+#endif
+#include <QStringList>
+#include <QTextStream>
+#include <QUrl>
+
+struct ReplayStatistics
+{
+    ReplayStatistics() :
+        calls(0),
+        results(0),
+        nsecs(0)
+    {
+    }
+
+    int calls;
+    qint64 results;
+    qint64 nsecs;
+};
+
+static bool loadContent(const QList<QByteArray> &fields, const QDir &corpus, QByteArray &content) {
+    if (fields.size() > 5) {
+        content = QByteArray::fromBase64(fields.at(5));
+        return true;
+    }
+
+    const QByteArray hash = fields.at(2);
+    QStringList fileNames;
+    const QString path = QUrl::fromPercentEncoding(fields.at(4));
+
+    if (!path.isEmpty()) {
+        fileNames << path;
+    }
+
+    fileNames << corpus.filePath(QString::fromLatin1(hash)) << corpus.filePath(QString::fromLatin1(hash + ".html"));
+
+    foreach (const QString &fileName, fileNames) {
+        QFile file(fileName);
+
+        if (file.open(QFile::ReadOnly)) {
+            content = file.readAll();
+
+            if (QCryptographicHash::hash(content, QCryptographicHash::Sha1).toHex() == hash) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static QHtmlElement resolvePath(const QHtmlDocument *document, const QByteArray &path) {
+    QHtmlElement element = document->documentElement();
+
+    foreach (const QByteArray &index, path.split('/')) {
+        if (index.isEmpty()) {
+            continue;
+        }
+
+        element = element.firstChildElement();
+
+        for (int i = index.toInt(); (i > 0) && (!element.isNull()); --i) {
+            element = element.nextSibling();
+        }
+    }
+
+    return element;
+}
+
+static QHtmlAttributeMatches decodeMatches(const QByteArray &field) {
+    QHtmlAttributeMatches matches;
+
+    foreach (const QByteArray &match, field.split(',')) {
+        const QList<QByteArray> parts = match.split(':');
+
+        if (parts.size() == 3) {
+            matches << QHtmlAttributeMatch(QUrl::fromPercentEncoding(parts.at(0)), QUrl::fromPercentEncoding(parts.at(1)),
+                                           QHtmlParser::MatchFlags(parts.at(2).toInt()));
+        }
+    }
+
+    return matches;
+}
+
+static int replayQuery(const QHtmlDocument *document, const QHtmlElement &element, const QByteArray &function,
+                       const QList<QByteArray> &args) {
+    if (function == "elementById") {
+        return element.elementById(QUrl::fromPercentEncoding(args.value(0))).isNull() ? 0 : 1;
+    }
+
+    if (function == "elementsWithAttribute") {
+        return element.elementsWithAttribute(QUrl::fromPercentEncoding(args.value(0))).size();
+    }
+
+    if (function == "elementsContainingText") {
+        return document->elementsContainingText(QUrl::fromPercentEncoding(args.value(0))).size();
+    }
+
+    if (function == "findText") {
+#if QT_VERSION >= 0x050000
+        const QRegularExpression regExp(QUrl::fromPercentEncoding(args.value(0)),
+                                        QRegularExpression::PatternOptions(args.value(1).toInt()));
+        return element.findText(regExp).size();
+#else
+        return -1;
+#endif
+    }
+
+    const bool nth = (function == "nthElementByTagName");
+    const int n = (nth ? args.value(0).toInt() : 0);
+    const int offset = (nth ? 1 : 0);
+    const QString name = QUrl::fromPercentEncoding(args.value(offset));
+
+    if (args.size() > offset + 1) {
+        const QHtmlAttributeMatches matches = decodeMatches(args.at(offset + 1));
+        const QHtmlParser::MatchType matchType = QHtmlParser::MatchType(args.value(offset + 2).toInt());
+
+        if (function == "elementsByTagName") {
+            if (args.size() > offset + 3) {
+                return element.elementsByTagName(name, matches, matchType, args.at(offset + 3).toInt()).size();
+            }
+
+            return element.elementsByTagName(name, matches, matchType).size();
+        }
+
+        if (function == "firstElementByTagName") {
+            return element.firstElementByTagName(name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        if (function == "lastElementByTagName") {
+            return element.lastElementByTagName(name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        if (nth) {
+            return element.nthElementByTagName(n, name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        if (function == "countElementsByTagName") {
+            return element.countElementsByTagName(name, matches, matchType);
+        }
+
+        if (function == "hasElementByTagName") {
+            return element.hasElementByTagName(name, matches, matchType) ? 1 : 0;
+        }
+
+        if (function == "childElementsByTagName") {
+            return element.childElementsByTagName(name, matches, matchType).size();
+        }
+
+        if (function == "nextSiblingByTagName") {
+            return element.nextSiblingByTagName(name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        if (function == "previousSiblingByTagName") {
+            return element.previousSiblingByTagName(name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        if (function == "closest") {
+            return element.closest(name, matches, matchType).isNull() ? 0 : 1;
+        }
+
+        return -1;
+    }
+
+    if (function == "elementsByTagName") {
+        return element.elementsByTagName(name).size();
+    }
+
+    if (function == "firstElementByTagName") {
+        return element.firstElementByTagName(name).isNull() ? 0 : 1;
+    }
+
+    if (function == "lastElementByTagName") {
+        return element.lastElementByTagName(name).isNull() ? 0 : 1;
+    }
+
+    if (nth) {
+        return element.nthElementByTagName(n, name).isNull() ? 0 : 1;
+    }
+
+    if (function == "countElementsByTagName") {
+        return element.countElementsByTagName(name);
+    }
+
+    if (function == "hasElementByTagName") {
+        return element.hasElementByTagName(name) ? 1 : 0;
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    QStringList args = app.arguments().mid(1);
+    QDir corpus(QDir::currentPath());
+    int iterations = 1;
+
+    while (args.size() > 1) {
+        if ((args.first() == "-c") && (args.size() > 2)) {
+            args.removeFirst();
+            corpus = QDir(args.takeFirst());
+        }
+        else if ((args.first() == "-n") && (args.size() > 2)) {
+            args.removeFirst();
+            iterations = qMax(1, args.takeFirst().toInt());
+        }
+        else {
+            break;
+        }
+    }
+
+    if (args.size() != 1) {
+        err << "Usage: qhtmlreplay [-c <corpus directory>] [-n <iterations>] <recording>\n";
+        return 1;
+    }
+
+    QFile file(args.first());
+
+    if (!file.open(QFile::ReadOnly)) {
+        err << "Cannot open " << file.fileName() << ": " << file.errorString() << "\n";
+        return 1;
+    }
+
+    const QList<QByteArray> lines = file.readAll().split('\n');
+
+    if ((lines.isEmpty()) || (!lines.first().startsWith("qhtmlparser-recording\t"))) {
+        err << file.fileName() << " is not a QHtmlParser recording\n";
+        return 1;
+    }
+
+    QMap<QByteArray, ReplayStatistics> statistics;
+    ReplayStatistics parsing;
+    int missing = 0;
+    int skipped = 0;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < iterations; ++i) {
+        QHash<QByteArray, QHtmlDocument*> documents;
+
+        for (int j = 1; j < lines.size(); ++j) {
+            const QList<QByteArray> fields = lines.at(j).split('\t');
+            const QByteArray &type = fields.first();
+
+            if ((type == "document") && (fields.size() >= 5)) {
+                QByteArray content;
+
+                if (!loadContent(fields, corpus, content)) {
+                    if (i == 0) {
+                        err << "Missing content for document " << fields.at(1) << " (" << fields.at(2) << ")\n";
+                        ++missing;
+                    }
+
+                    continue;
+                }
+
+                QHtmlDocument *document = new QHtmlDocument;
+                timer.start();
+                document->setContent(content);
+                parsing.nsecs += timer.nsecsElapsed();
+                ++parsing.calls;
+                parsing.results += content.size();
+                delete documents.value(fields.at(1));
+                documents.insert(fields.at(1), document);
+            }
+            else if ((type == "options") && (fields.size() >= 6)) {
+                QHtmlDocument *document = documents.value(fields.at(1));
+
+                if (document) {
+                    QStringList names;
+
+                    foreach (const QByteArray &name, fields.at(5).split(',')) {
+                        if (!name.isEmpty()) {
+                            names << QUrl::fromPercentEncoding(name);
+                        }
+                    }
+
+                    document->setQueryCacheEnabled(fields.at(2) == "1");
+                    document->setAttributeIndexEnabled(fields.at(3) == "1");
+                    document->setTextIndexEnabled(fields.at(4) == "1");
+                    document->setValueIndexedAttributes(names);
+                }
+            }
+            else if ((type == "release") && (fields.size() >= 2)) {
+                delete documents.take(fields.at(1));
+            }
+            else if ((type == "query") && (fields.size() >= 4)) {
+                const QHtmlDocument *document = documents.value(fields.at(1));
+
+                if (!document) {
+                    ++skipped;
+                    continue;
+                }
+
+                const QHtmlElement element = resolvePath(document, fields.at(2));
+
+                if (element.isNull()) {
+                    ++skipped;
+                    continue;
+                }
+
+                timer.start();
+                const int results = replayQuery(document, element, fields.at(3), fields.mid(4));
+                const qint64 nsecs = timer.nsecsElapsed();
+
+                if (results < 0) {
+                    ++skipped;
+                    continue;
+                }
+
+                ReplayStatistics &stats = statistics[fields.at(3)];
+                ++stats.calls;
+                stats.results += results;
+                stats.nsecs += nsecs;
+            }
+        }
+
+        qDeleteAll(documents);
+    }
+
+    out << "documents: " << parsing.calls << " (" << missing << " missing), " << parsing.results << " bytes, "
+        << parsing.nsecs / 1000000.0 << " ms\n";
+    out << "skipped queries: " << skipped << "\n";
+    out << "function\tcalls\tresults\ttotal ms\tmean us\n";
+
+    QMapIterator<QByteArray, ReplayStatistics> iterator(statistics);
+
+    while (iterator.hasNext()) {
+        iterator.next();
+        const ReplayStatistics &stats = iterator.value();
+        out << iterator.key() << "\t" << stats.calls << "\t" << stats.results << "\t" << stats.nsecs / 1000000.0
+            << "\t" << stats.nsecs / 1000.0 / stats.calls << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+TEMPLATE = app
+TARGET = qhtmlreplay
+QT += core
+QT -= gui
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../../src
+LIBS += -L../../src -lqhtmlparser
+
+SOURCES += \
+    main.cpp